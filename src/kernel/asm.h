@@ -2,6 +2,7 @@
 #define __X86_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define RFLAGS_CF	(1 << 0) // Carry flag
 // reserved		(1 << 1)
@@ -41,11 +42,40 @@ static inline uint16_t inw(int port)
 	return data;
 }
 
+static inline uint32_t inl(int port)
+{
+	uint32_t data;
+	__asm__ volatile("inl %w1,%0" : "=a" (data) : "d" (port));
+	return data;
+}
+
 static inline void outb(int port, uint8_t data)
 {
 	__asm__ volatile("outb %0,%w1" : : "a" (data), "d" (port));
 }
 
+static inline void outw(int port, uint16_t data)
+{
+	__asm__ volatile("outw %0,%w1" : : "a" (data), "d" (port));
+}
+
+static inline void outl(int port, uint32_t data)
+{
+	__asm__ volatile("outl %0,%w1" : : "a" (data), "d" (port));
+}
+
+static inline void insw(int port, void *addr, size_t cnt)
+{
+	__asm__ volatile("cld; rep insw"
+			 : "+D" (addr), "+c" (cnt) : "d" (port) : "memory", "cc");
+}
+
+static inline void outsw(int port, const void *addr, size_t cnt)
+{
+	__asm__ volatile("cld; rep outsw"
+			 : "+S" (addr), "+c" (cnt) : "d" (port) : "cc");
+}
+
 static inline void ltr(uint16_t sel)
 {
 	__asm__ volatile("ltr %0" : : "r" (sel));
@@ -58,20 +88,57 @@ static inline void invlpg(void *m)
 	__asm__ volatile("invlpg (%0)" : : "b" (m) : "memory");
 }
 
-// Write a 64-bit value to a MSR. The A constraint stands
-// for concatenation of registers EAX and EDX.
+#define MSR_EFER		0xC0000080
+#define MSR_STAR		0xC0000081 // segments for syscall/sysret
+#define MSR_LSTAR		0xC0000082 // syscall entry point
+#define MSR_SFMASK		0xC0000084 // rflags bits cleared by syscall
+#define MSR_KERNEL_GS_BASE	0xC0000102 // swapped with gs base by swapgs
+#define MSR_TSC_DEADLINE	0x6E0 // local APIC timer deadline
+
+#define EFER_SCE		(1 << 0) // syscall/sysret enable
+
+// Write a 64-bit value to a MSR. Value is passed in EDX:EAX (the `A'
+// constraint means RAX or RDX in 64-bit mode, so it can't be used).
 static inline void wrmsr(uint32_t msr_id, uint64_t value)
 {
-	__asm__ volatile("wrmsr" : : "c" (msr_id), "A" (value));
+	__asm__ volatile("wrmsr" : : "c" (msr_id), "a" ((uint32_t)value),
+			 "d" ((uint32_t)(value >> 32)));
 }
 
-// Read a 64-bit value from a MSR. The A constraint stands
-// for concatenation of registers EAX and EDX.
+// Read a 64-bit value from a MSR (returned in EDX:EAX)
 static inline uint64_t rdmsr(uint32_t msr_id)
 {
-	uint64_t value;
-	__asm__ volatile("rdmsr" : "=A" (value) : "c" (msr_id));
-	return value;
+	uint32_t lo, hi;
+	__asm__ volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr_id));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// Disable interrupts, return previous rflags value
+static inline uintptr_t irq_save(void)
+{
+	uintptr_t flags;
+	__asm__ volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+// Enable interrupts if they were enabled before `irq_save'
+static inline void irq_restore(uintptr_t flags)
+{
+	if ((flags & RFLAGS_IF) != 0)
+		__asm__ volatile("sti" : : : "memory");
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// Spin loop hint
+static inline void pause(void)
+{
+	__asm__ volatile("pause" : : : "memory");
 }
 
 static inline void lcr3(uintptr_t val)
@@ -86,6 +153,24 @@ static inline uintptr_t rcr3(void)
 	return val;
 }
 
+#define CR3_PCID_MASK	0xFFF		// address space id (if CR4_PCIDE is set)
+#define CR3_NOFLUSH	(1ull << 63)	// keep TLB entries of loaded PCID
+
+#define CR4_PGE		(1 << 7)	// global pages
+#define CR4_PCIDE	(1 << 17)	// process-context identifiers
+
+static inline void lcr4(uintptr_t val)
+{
+	__asm__ volatile("movq %0, %%cr4" : : "r" (val));
+}
+
+static inline uintptr_t rcr4(void)
+{
+	uintptr_t val;
+	__asm__ volatile("movq %%cr4, %0" : "=r" (val));
+	return val;
+}
+
 static inline uintptr_t rrsp(void)
 {
 	uintptr_t val;
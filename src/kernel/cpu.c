@@ -1,13 +1,33 @@
+#include <stddef.h>
+
+#include "kernel/asm.h"
 #include "kernel/cpu.h"
+#include "kernel/interrupt/apic.h"
+#include "kernel/interrupt/interrupt.h"
+#include "kernel/lib/sync/spinlock.h"
 #include "stdlib/assert.h"
 
-// TODO: append cpu (via spinlock)
+_Static_assert(offsetof(struct cpu_context, kernel_rsp) == CPU_KERNEL_RSP, "update CPU_KERNEL_RSP");
+_Static_assert(offsetof(struct cpu_context, user_rsp) == CPU_USER_RSP, "update CPU_USER_RSP");
+
+// Logic ids are assigned in order of `cpu_register' calls
 static struct cpu_map cpu_map[CPU_MAX_CNT];
+static volatile cpuid_t cpu_cnt;
 static struct cpu_context context[CPU_MAX_CNT];
 
+// Big kernel lock. Interrupt handlers take it on entry and `task_run'
+// releases it, so kernel code is executed by one cpu at a time.
+static struct spinlock kernel_spinlock;
+static volatile cpuid_t kernel_lock_owner = CPU_ID_NONE;
+
+static hardware_cpuid_t cpu_hardware_id(void)
+{
+	return APIC_READ(APIC_OFFSET_ID) >> 24;
+}
+
 cpuid_t cpu_id_by_hardware_id(hardware_cpuid_t id)
 {
-	for (uint32_t i = 0; i < CPU_MAX_CNT; i++) {
+	for (cpuid_t i = 0; i < cpu_cnt; i++) {
 		if (cpu_map[i].real_id == id)
 			return i;
 	}
@@ -15,9 +35,44 @@ cpuid_t cpu_id_by_hardware_id(hardware_cpuid_t id)
 	return CPU_ID_NONE;
 }
 
+// Called once by each processor, the first one becomes cpu `0'
+void cpu_register(void)
+{
+	cpuid_t id = __atomic_fetch_add(&cpu_cnt, 1, __ATOMIC_ACQ_REL);
+
+	if (id >= CPU_MAX_CNT)
+		panic("too many cpus");
+
+	cpu_map[id].real_id = cpu_hardware_id();
+	cpu_map[id].logic_id = id;
+
+	if (id == 0)
+		spinlock_init(&kernel_spinlock, "kernel");
+}
+
+cpuid_t cpu_count(void)
+{
+	return cpu_cnt;
+}
+
+// Sends IPI, so cpu `id' calls `schedule'
+void cpu_reschedule(cpuid_t id)
+{
+	assert(id < cpu_cnt);
+
+	APIC_WRITE(APIC_OFFSET_ICR_HIGH, cpu_map[id].real_id << 24);
+	APIC_WRITE(APIC_OFFSET_ICR_LOW, INTERRUPT_VECTOR_RESCHEDULE);
+
+	while ((APIC_READ(APIC_OFFSET_ICR_LOW) & APIC_ICR_PENDING) != 0)
+		pause();
+}
+
 cpuid_t cpu_get_id(void)
 {
-	return 0;
+	cpuid_t id = cpu_id_by_hardware_id(cpu_hardware_id());
+
+	assert(id != CPU_ID_NONE);
+	return id;
 }
 
 struct cpu_context *cpu_context_by_id(cpuid_t id)
@@ -31,3 +86,29 @@ struct cpu_context *cpu_context(void)
 	cpuid_t id = cpu_get_id();
 	return cpu_context_by_id(id);
 }
+
+struct page_cache *cpu_page_cache(void)
+{
+	return &cpu_context()->page_cache;
+}
+
+// Must be called with disabled interrupts. Lock may be taken again
+// by the owner (e.g. page fault inside kernel).
+void kernel_lock(void)
+{
+	cpuid_t id = cpu_get_id();
+
+	if (kernel_lock_owner == id)
+		return;
+
+	spin_lock(&kernel_spinlock);
+	kernel_lock_owner = id;
+}
+
+void kernel_unlock(void)
+{
+	assert(kernel_lock_owner == cpu_get_id());
+
+	kernel_lock_owner = CPU_ID_NONE;
+	spin_unlock(&kernel_spinlock);
+}
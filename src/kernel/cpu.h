@@ -1,30 +1,75 @@
 #ifndef __CPU_H__
 #define __CPU_H__
 
+#define CPU_MAX_CNT	32
+
+// Offsets inside `struct cpu_context', used by `syscall' entry
+#define CPU_KERNEL_RSP	0x0
+#define CPU_USER_RSP	0x8
+
+#ifndef __ASSEMBLER__
+
 #include <stdint.h>
 
 #include "task.h"
-
-#define CPU_MAX_CNT	32
-#define CPU_ID_NONE	-1
+#include "tlb.h"
+#include "kernel/lib/memory/map.h"
 
 typedef uint32_t hardware_cpuid_t;
 typedef uint16_t cpuid_t;
 
+#define CPU_ID_NONE	((cpuid_t)-1)
+
 struct cpu_map {
 	hardware_cpuid_t real_id;
 	cpuid_t logic_id;
 };
 
 struct cpu_context {
+	// Must be at the beginning (see `CPU_KERNEL_RSP')
+	uintptr_t kernel_rsp;	// stack for `syscall' instruction
+	uintptr_t user_rsp;	// scratch slot for user rsp
+
 	pml4e_t *pml4;
+	struct tlb_pcid pcid;	// PCIDs of recently used address spaces
 
 	struct task *task;
 	struct task self_task;
+
+	// Runs only when run queue is empty, isn't inside run queue
+	struct task *idle;
+	uint64_t idle_time;	// tsc cycles spent inside idle task
+	uint64_t idle_start;	// tsc, when idle task was started last time
+	uint64_t start_time;	// tsc, when cpu started scheduling
+
+	// Tsc value, when local APIC timer fires (0 - timer is off)
+	uint64_t timer_deadline;
+	// Tsc value, when time slice of the current task ends (0 - no
+	// other ready tasks, so slice isn't counted)
+	uint64_t slice_end;
+	struct timer_wheel timer_wheel;
+
+	// Ready tasks of this cpu
+	struct task_runq runq;
+	bool online;		// cpu schedules tasks
+
+	// Order-0 pages, which may be allocated without touching
+	// global allocator state
+	struct page_cache page_cache;
 };
 
+void cpu_register(void);
+cpuid_t cpu_count(void);
+void cpu_reschedule(cpuid_t id);
+
+void kernel_lock(void);
+void kernel_unlock(void);
+
 cpuid_t cpu_get_id(void);
 struct cpu_context *cpu_context(void);
 struct cpu_context *cpu_context_by_id(cpuid_t id);
+struct page_cache *cpu_page_cache(void);
+
+#endif // !__ASSEMBLER__
 
 #endif
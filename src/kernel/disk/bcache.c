@@ -0,0 +1,401 @@
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/lib/memory/map.h"
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/thread.h"
+#include "kernel/disk/bcache.h"
+#include "kernel/misc/util.h"
+
+TAILQ_HEAD(bcache_lru, buf);
+LIST_HEAD(bcache_hash, buf);
+
+// Block cache of the ata disk, changed under kernel lock. Functions,
+// which may sleep, are called only by kernel threads.
+static struct {
+	struct buf bufs[BCACHE_BUF_CNT];
+	struct bcache_hash hash[BCACHE_HASH_SIZE];
+	struct bcache_lru lru;	// unreferenced buffers, the least recently used first
+
+	// Single sequential stream is detected
+	struct {
+		uint32_t next;		// lba, which continues the stream
+		uint32_t end;		// lba after the last read ahead block
+		uint32_t window;	// blocks, 0 if access is random
+	} ra;
+
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t written;	// blocks written back
+		uint64_t ra;		// blocks read ahead
+		uint64_t ra_hits;	// read ahead blocks, which were accessed
+	} stat;
+} bcache;
+
+static struct bcache_hash *bcache_hash(uint32_t lba)
+{
+	return &bcache.hash[(lba / BCACHE_BLOCK_SECTORS) % BCACHE_HASH_SIZE];
+}
+
+static struct buf *bcache_lookup(uint32_t lba)
+{
+	struct buf *buf;
+
+	LIST_FOREACH(buf, bcache_hash(lba), hash_link) {
+		if (buf->lba == lba)
+			return buf;
+	}
+
+	return NULL;
+}
+
+static void bcache_io_done(struct ide_request *req)
+{
+	struct buf *buf = req->arg;
+	struct task *task;
+
+	buf->flags &= ~BUF_BUSY;
+	if (req->status == 0 && req->write == false)
+		buf->flags |= BUF_VALID;
+	if (req->status != 0 && req->write == true)
+		// Flusher will try again
+		buf->flags |= BUF_DIRTY;
+
+	while ((task = TAILQ_FIRST(&buf->waiters)) != NULL) {
+		TAILQ_REMOVE(&buf->waiters, task, wait_link);
+		task_make_ready(task);
+	}
+}
+
+// Starts disk request, `bcache_io_done' is called on completion
+static int bcache_io(struct buf *buf, bool write)
+{
+	memset(&buf->req, 0, sizeof(buf->req));
+	buf->req.lba = buf->lba;
+	buf->req.count = BCACHE_BLOCK_SECTORS;
+	buf->req.write = write;
+	buf->req.buf = buf->data;
+	buf->req.done = bcache_io_done;
+	buf->req.arg = buf;
+
+	// Request may fail before `ide_submit' returns
+	buf->flags |= BUF_BUSY;
+	if (write) {
+		buf->flags &= ~BUF_DIRTY;
+		bcache.stat.written++;
+	}
+
+	if (ide_submit(&buf->req) != 0) {
+		buf->flags &= ~BUF_BUSY;
+		if (write)
+			buf->flags |= BUF_DIRTY;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// Thread sleeps until disk request of the buffer is completed. Kernel
+// lock is released by the next task and taken again on wake up.
+static void bcache_wait(struct buf *buf)
+{
+	struct task *task = cpu_context()->task;
+
+	while ((buf->flags & BUF_BUSY) != 0) {
+		TAILQ_INSERT_TAIL(&buf->waiters, task, wait_link);
+		task->state = TASK_STATE_DONT_RUN;
+
+		// call schedule
+		asm volatile("int3");
+
+		irq_save();
+		kernel_lock();
+	}
+}
+
+// Returns the least recently used clean buffer, which isn't referenced
+static struct buf *bcache_evict_clean(void)
+{
+	struct buf *buf;
+
+	TAILQ_FOREACH(buf, &bcache.lru, lru_link) {
+		if ((buf->flags & (BUF_BUSY | BUF_DIRTY)) == 0)
+			return buf;
+	}
+
+	return NULL;
+}
+
+// Dirty buffers are written back, if there are no clean ones
+static struct buf *bcache_evict(void)
+{
+	struct buf *buf;
+
+	while (TAILQ_EMPTY(&bcache.lru) == false) {
+		if ((buf = bcache_evict_clean()) != NULL)
+			return buf;
+
+		buf = TAILQ_FIRST(&bcache.lru);
+		if ((buf->flags & BUF_BUSY) == 0 && bcache_io(buf, true) != 0)
+			return NULL;
+		bcache_wait(buf);
+
+		if ((buf->flags & BUF_DIRTY) != 0)
+			// Write back failed
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static void bcache_assign(struct buf *buf, uint32_t lba)
+{
+	if (buf->hash_link.le_prev != NULL)
+		LIST_REMOVE(buf, hash_link);
+	buf->lba = lba;
+	buf->flags = 0;
+	LIST_INSERT_HEAD(bcache_hash(lba), buf, hash_link);
+}
+
+// Starts reading of blocks after `lba', if access is sequential. Window
+// grows while stream continues, so later reads find their blocks in
+// cache or in flight. Read ahead never sleeps and evicts only clean
+// buffers, prefetched blocks stay unreferenced.
+static void bcache_read_ahead(uint32_t lba)
+{
+	uint32_t end;
+
+	if (lba == bcache.ra.next)
+		bcache.ra.window = MIN(MAX(bcache.ra.window * 2, BCACHE_RA_MIN), BCACHE_RA_MAX);
+	else
+		bcache.ra.window = 0;
+	bcache.ra.next = lba + BCACHE_BLOCK_SECTORS;
+
+	if (bcache.ra.window == 0)
+		return;
+
+	// Blocks before `ra.end' were requested already
+	end = lba + (bcache.ra.window + 1) * BCACHE_BLOCK_SECTORS;
+	if (bcache.ra.end <= lba || bcache.ra.end > end)
+		bcache.ra.end = lba + BCACHE_BLOCK_SECTORS;
+
+	for (; bcache.ra.end < end; bcache.ra.end += BCACHE_BLOCK_SECTORS) {
+		struct buf *buf;
+
+		if (bcache_lookup(bcache.ra.end) != NULL)
+			continue;
+		if ((buf = bcache_evict_clean()) == NULL)
+			break;
+
+		bcache_assign(buf, bcache.ra.end);
+		if (bcache_io(buf, false) != 0)
+			// End of disk
+			break;
+
+		// Keep it away from the head of lru
+		TAILQ_REMOVE(&bcache.lru, buf, lru_link);
+		TAILQ_INSERT_TAIL(&bcache.lru, buf, lru_link);
+
+		buf->flags |= BUF_RA;
+		bcache.stat.ra++;
+	}
+}
+
+// Returns referenced buffer with data of the block, which starts at `lba'
+struct buf *bcache_read(uint32_t lba)
+{
+	uintptr_t flags = irq_save();
+	struct buf *buf;
+
+	assert(lba % BCACHE_BLOCK_SECTORS == 0);
+	kernel_lock();
+
+	while ((buf = bcache_lookup(lba)) == NULL) {
+		if ((buf = bcache_evict()) == NULL) {
+			terminal_printf("Can't read block %u: all buffers are in use\n", lba);
+			goto out;
+		}
+
+		// Other thread may load the block, while this one was sleeping
+		if (bcache_lookup(lba) != NULL)
+			continue;
+
+		bcache_assign(buf, lba);
+
+		break;
+	}
+
+	if (buf->ref++ == 0)
+		TAILQ_REMOVE(&bcache.lru, buf, lru_link);
+
+	if ((buf->flags & (BUF_VALID | BUF_BUSY)) == 0) {
+		bcache.stat.misses++;
+		if (bcache_io(buf, false) != 0)
+			goto fail;
+	} else {
+		bcache.stat.hits++;
+	}
+
+	if ((buf->flags & BUF_RA) != 0) {
+		buf->flags &= ~BUF_RA;
+		bcache.stat.ra_hits++;
+	}
+
+	// Requests are queued behind the one of this block
+	bcache_read_ahead(lba);
+
+	bcache_wait(buf);
+	if ((buf->flags & BUF_VALID) == 0)
+		goto fail;
+
+out:
+	kernel_unlock();
+	irq_restore(flags);
+
+	return buf;
+
+fail:
+	terminal_printf("Can't read block %u: disk request failed\n", lba);
+	if (--buf->ref == 0)
+		TAILQ_INSERT_TAIL(&bcache.lru, buf, lru_link);
+	buf = NULL;
+
+	goto out;
+}
+
+// Copies `size' bytes starting from sector `lba' through the cache
+int bcache_read_segment(void *dst, uint32_t size, uint32_t lba)
+{
+	uint32_t block = ROUND_DOWN(lba, BCACHE_BLOCK_SECTORS);
+	uint32_t offset = (lba - block) * ATA_SECTOR_SIZE;
+	uint8_t *p = dst;
+
+	for (; size != 0; block += BCACHE_BLOCK_SECTORS, offset = 0) {
+		uint32_t len = MIN(size, BCACHE_BLOCK_SIZE - offset);
+		struct buf *buf;
+
+		if ((buf = bcache_read(block)) == NULL)
+			return -1;
+
+		memcpy(p, (uint8_t *)buf->data + offset, len);
+		bcache_release(buf);
+
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+// Data will be written back by flusher thread
+void bcache_write(struct buf *buf)
+{
+	uintptr_t flags = irq_save();
+
+	kernel_lock();
+	assert(buf->ref != 0 && (buf->flags & BUF_VALID) != 0);
+	buf->flags |= BUF_DIRTY;
+	kernel_unlock();
+
+	irq_restore(flags);
+}
+
+void bcache_release(struct buf *buf)
+{
+	uintptr_t flags = irq_save();
+
+	kernel_lock();
+	assert(buf->ref != 0);
+	if (--buf->ref == 0)
+		TAILQ_INSERT_TAIL(&bcache.lru, buf, lru_link);
+	kernel_unlock();
+
+	irq_restore(flags);
+}
+
+// Starts write back of all dirty buffers, doesn't wait for completion
+void bcache_flush(void)
+{
+	uintptr_t flags = irq_save();
+
+	kernel_lock();
+	for (uint32_t i = 0; i < BCACHE_BUF_CNT; i++) {
+		struct buf *buf = &bcache.bufs[i];
+
+		if ((buf->flags & (BUF_DIRTY | BUF_BUSY)) == BUF_DIRTY)
+			bcache_io(buf, true);
+	}
+	kernel_unlock();
+
+	irq_restore(flags);
+}
+
+static void bcache_flusher(void *arg)
+{
+	uintptr_t flags;
+
+	(void)arg;
+
+	while (1) {
+		bcache_flush();
+
+		flags = irq_save();
+		kernel_lock();
+		task_sleep(cpu_context()->task, BCACHE_FLUSH_MS);
+
+		// call schedule, timer wakes thread up, kernel lock is
+		// released by the next task
+		asm volatile("int3");
+		irq_restore(flags);
+	}
+}
+
+void bcache_init(void)
+{
+	struct task *flusher;
+
+	for (uint32_t i = 0; i < BCACHE_HASH_SIZE; i++)
+		LIST_INIT(&bcache.hash[i]);
+	TAILQ_INIT(&bcache.lru);
+
+	for (uint32_t i = 0; i < BCACHE_BUF_CNT; i++) {
+		struct buf *buf = &bcache.bufs[i];
+		struct page *page;
+
+		if ((page = page_alloc()) == NULL)
+			panic("not enough memory for block cache");
+		page_incref(page);
+
+		buf->data = page2kva(page);
+		TAILQ_INIT(&buf->waiters);
+		TAILQ_INSERT_TAIL(&bcache.lru, buf, lru_link);
+	}
+
+	if ((flusher = thread_create("bflush", bcache_flusher, NULL, 0)) == NULL)
+		panic("can't create block cache flusher");
+	thread_run(flusher);
+}
+
+void bcache_stat(void)
+{
+	uint32_t dirty = 0, referenced = 0;
+
+	for (uint32_t i = 0; i < BCACHE_BUF_CNT; i++) {
+		if ((bcache.bufs[i].flags & BUF_DIRTY) != 0)
+			dirty++;
+		if (bcache.bufs[i].ref != 0)
+			referenced++;
+	}
+
+	terminal_printf("buffers: %u, dirty: %u, referenced: %u\n",
+			BCACHE_BUF_CNT, dirty, referenced);
+	terminal_printf("hits: %lu, misses: %lu, written: %lu\n",
+			bcache.stat.hits, bcache.stat.misses, bcache.stat.written);
+	terminal_printf("read ahead: %lu, used: %lu, window: %u\n",
+			bcache.stat.ra, bcache.stat.ra_hits, bcache.ra.window);
+}
@@ -0,0 +1,52 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+
+#include "stdlib/queue.h"
+#include "kernel/task.h"
+#include "kernel/disk/ide.h"
+#include "kernel/lib/disk/ata.h"
+
+// Block is a page, so its data may be transferred by dma
+#define BCACHE_BLOCK_SECTORS	8
+#define BCACHE_BLOCK_SIZE	(BCACHE_BLOCK_SECTORS * ATA_SECTOR_SIZE)
+
+#define BCACHE_BUF_CNT		256	// 1Mb of cached data
+#define BCACHE_HASH_SIZE	64
+
+#define BCACHE_FLUSH_MS		1000	// write back period
+
+// Read-ahead window (in blocks) doubles on each sequential read
+#define BCACHE_RA_MIN		4u
+#define BCACHE_RA_MAX		32u
+
+#define BUF_VALID	(1 << 0)	// data was read from disk
+#define BUF_DIRTY	(1 << 1)	// data must be written back
+#define BUF_BUSY	(1 << 2)	// disk request is in progress
+#define BUF_RA		(1 << 3)	// read ahead, but not accessed yet
+
+struct buf {
+	uint32_t lba;		// the first sector of the block
+	uint32_t ref;		// referenced buffer isn't evicted
+	uint32_t flags;
+	void *data;
+
+	LIST_ENTRY(buf) hash_link;	// link in the lba hash
+	TAILQ_ENTRY(buf) lru_link;	// link in the lru list (if not referenced)
+
+	struct task_queue waiters;	// tasks waiting for `BUF_BUSY' to clear
+	struct ide_request req;
+};
+
+void bcache_init(void);
+
+struct buf *bcache_read(uint32_t lba);
+int bcache_read_segment(void *dst, uint32_t size, uint32_t lba);
+void bcache_write(struct buf *buf);
+void bcache_release(struct buf *buf);
+void bcache_flush(void);
+
+void bcache_stat(void);
+
+#endif
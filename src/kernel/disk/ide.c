@@ -0,0 +1,406 @@
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/lib/disk/ata.h"
+#include "kernel/lib/memory/map.h"
+#include "kernel/lib/memory/layout.h"
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/pci.h"
+#include "kernel/task.h"
+#include "kernel/disk/ide.h"
+#include "kernel/misc/util.h"
+#include "kernel/interrupt/apic.h"
+
+// Status polls before command is considered failed
+#define IDE_POLL_MAX		1000000
+
+// Bus master registers of the primary channel (offsets from BAR4)
+#define IDE_BM_COMMAND		0x0
+#define IDE_BM_STATUS		0x2
+#define IDE_BM_PRDT		0x4
+
+#define IDE_BM_COMMAND_START	(1 << 0)
+#define IDE_BM_COMMAND_READ	(1 << 3)	// device writes to memory
+
+#define IDE_BM_STATUS_ACTIVE	(1 << 0)
+#define IDE_BM_STATUS_ERR	(1 << 1)	// write 1 to clear
+#define IDE_BM_STATUS_IRQ	(1 << 2)	// write 1 to clear
+
+// Physical region descriptor. Region can't cross 64Kb boundary,
+// zero size means 64Kb.
+struct ide_prd {
+	uint32_t addr;
+	uint16_t size;
+	uint16_t flags;
+} __attribute__((packed));
+
+#define IDE_PRD_EOT		(1 << 15)	// the last entry of the table
+#define IDE_PRD_BOUNDARY	0x10000
+
+// Bus master addresses are 32 bits wide
+#define IDE_DMA_LIMIT		0x100000000ull
+
+TAILQ_HEAD(ide_queue, ide_request);
+
+// Primary master device. Changed under kernel lock.
+static struct {
+	bool present;
+	uint32_t size;		// sectors accessible by LBA28
+	uint32_t multiple;	// sectors per interrupt (DRQ block)
+
+	uint16_t bmdma;		// bus master io base, 0 if dma isn't used
+	struct ide_prd *prd;	// table of the active request
+
+	struct ide_queue queue;		// pending requests, sorted by lba
+	struct ide_request *active;	// request owned by device
+	uint32_t head;			// lba after the last started request
+
+	struct {
+		uint64_t requests;
+		uint64_t read;		// sectors
+		uint64_t written;	// sectors
+		uint64_t interrupts;
+		uint64_t errors;
+		uint64_t dma;		// requests transferred by bus master
+	} stat;
+} ide;
+
+// Reading alternate status takes 100ns, device needs 400ns to set
+// status after command
+static void ide_delay(void)
+{
+	for (int i = 0; i < 4; i++)
+		inb(ATA_PIO_PORT_CONTROL);
+}
+
+// Used only to start commands, data is transferred by interrupt handler
+static int ide_poll(bool drq)
+{
+	for (uint32_t i = 0; i < IDE_POLL_MAX; i++) {
+		uint8_t status = inb(ATA_PIO_PORT_STATUS);
+
+		if ((status & ATA_PIO_STATUS_BSY) != 0)
+			continue;
+		if ((status & (ATA_PIO_STATUS_ERR | ATA_PIO_STATUS_DF)) != 0)
+			return -1;
+		if (drq == false || (status & ATA_PIO_STATUS_DRQ) != 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+// PIIX compatible controller, ata commands still go through legacy ports
+static void ide_dma_init(void)
+{
+	struct pci_device *pci = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+	struct page *page;
+	uint32_t bar;
+
+	if (pci == NULL || (pci->prog_if & PCI_PROG_IF_IDE_BM) == 0)
+		return;
+
+	bar = pci_read(pci, PCI_BAR(4));
+	if ((bar & PCI_BAR_IO) == 0 || (bar & PCI_BAR_IO_MASK) == 0)
+		return;
+
+	// Table is page aligned, so it doesn't cross 64Kb boundary
+	if ((page = page_alloc()) == NULL || page2pa(page) >= IDE_DMA_LIMIT) {
+		if (page != NULL)
+			page_free(page);
+		terminal_printf("Can't init ata dma: no memory for prd table\n");
+		return;
+	}
+	page_incref(page);
+
+	pci_write16(pci, PCI_COMMAND, (pci_read(pci, PCI_COMMAND) & 0xFFFF) |
+		    PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+	ide.prd = page2kva(page);
+	ide.bmdma = bar & PCI_BAR_IO_MASK;
+}
+
+int ide_init(void)
+{
+	uint16_t id[ATA_SECTOR_SIZE / sizeof(uint16_t)];
+
+	TAILQ_INIT(&ide.queue);
+
+	// Identify device with disabled interrupts
+	outb(ATA_PIO_PORT_CONTROL, ATA_PIO_CONTROL_NIEN);
+	outb(ATA_PIO_PORT_DRIVE, ATA_PIO_DRIVE_MASTER);
+	ide_delay();
+	if (inb(ATA_PIO_PORT_STATUS) == 0xFF) {
+		terminal_printf("Can't init ata: no device\n");
+		return -1;
+	}
+
+	outb(ATA_PIO_PORT_COMMAND, ATA_PIO_CMD_IDENTIFY);
+	ide_delay();
+	if (inb(ATA_PIO_PORT_STATUS) == 0 || ide_poll(true) != 0) {
+		terminal_printf("Can't init ata: identify failed\n");
+		return -1;
+	}
+	insw(ATA_PIO_PORT_DATA, id, ARRAY_SIZE(id));
+
+	ide.size = id[60] | ((uint32_t)id[61] << 16);
+
+	// READ/WRITE MULTIPLE raise one interrupt per block of sectors
+	ide.multiple = 1;
+	if ((id[47] & 0xFF) != 0) {
+		outb(ATA_PIO_PORT_SECT_CNT, id[47] & 0xFF);
+		outb(ATA_PIO_PORT_COMMAND, ATA_PIO_CMD_SET_MULTIPLE);
+		ide_delay();
+		if (ide_poll(false) == 0)
+			ide.multiple = id[47] & 0xFF;
+	}
+
+	// Word 49 bit 8 - dma is supported
+	if ((id[49] & (1 << 8)) != 0)
+		ide_dma_init();
+
+	outb(ATA_PIO_PORT_CONTROL, 0);
+	ide.present = true;
+
+	terminal_printf("[ATA] sectors: %u, sectors per interrupt: %u, dma: %s\n",
+			ide.size, ide.multiple, ide.bmdma != 0 ? "yes" : "no");
+
+	return 0;
+}
+
+// Moves the next DRQ block of the active request
+static void ide_transfer(struct ide_request *req)
+{
+	uint32_t cnt = MIN(req->left, ide.multiple);
+	uint8_t *buf = (uint8_t *)req->buf + (req->count - req->left) * ATA_SECTOR_SIZE;
+
+	if (req->write)
+		outsw(ATA_PIO_PORT_DATA, buf, cnt * ATA_SECTOR_SIZE / sizeof(uint16_t));
+	else
+		insw(ATA_PIO_PORT_DATA, buf, cnt * ATA_SECTOR_SIZE / sizeof(uint16_t));
+
+	req->left -= cnt;
+}
+
+// Buffer is described by physical regions. Direct mapping is physically
+// contiguous, so regions are split only at 64Kb boundaries. Other
+// buffers (and ones above 4Gb) are transferred by pio.
+static int ide_prd_build(struct ide_request *req)
+{
+	uintptr_t va = (uintptr_t)req->buf;
+	size_t size = req->count * ATA_SECTOR_SIZE;
+	uint32_t cnt = 0;
+
+	if (va < KERNEL_BASE || va % sizeof(uint16_t) != 0 ||
+	    PADDR(va) + size > IDE_DMA_LIMIT)
+		return -1;
+
+	while (size != 0) {
+		uintptr_t pa = PADDR(va);
+		size_t len = MIN(size, IDE_PRD_BOUNDARY - pa % IDE_PRD_BOUNDARY);
+
+		assert(cnt < PAGE_SIZE / sizeof(struct ide_prd));
+
+		ide.prd[cnt].addr = pa;
+		ide.prd[cnt].size = len % IDE_PRD_BOUNDARY;
+		ide.prd[cnt].flags = 0;
+		cnt++;
+
+		va += len;
+		size -= len;
+	}
+	ide.prd[cnt - 1].flags = IDE_PRD_EOT;
+
+	return 0;
+}
+
+static int ide_command(struct ide_request *req)
+{
+	bool multiple = ide.multiple > 1;
+	uint8_t command, bm_command = 0;
+
+	if (ide_poll(false) != 0)
+		return -1;
+
+	req->dma = ide.bmdma != 0 && ide_prd_build(req) == 0;
+
+	if (req->dma)
+		command = req->write ? ATA_PIO_CMD_WRITE_DMA : ATA_PIO_CMD_READ_DMA;
+	else if (req->write)
+		command = multiple ? ATA_PIO_CMD_WRITE_MULTIPLE : ATA_PIO_CMD_WRITE;
+	else
+		command = multiple ? ATA_PIO_CMD_READ_MULTIPLE : ATA_PIO_CMD_READ;
+
+	if (req->dma) {
+		bm_command = req->write ? 0 : IDE_BM_COMMAND_READ;
+
+		outl(ide.bmdma + IDE_BM_PRDT, PADDR(ide.prd));
+		outb(ide.bmdma + IDE_BM_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+		outb(ide.bmdma + IDE_BM_COMMAND, bm_command);
+	}
+
+	// Sector count 0 means 256 sectors
+	outb(ATA_PIO_PORT_SECT_CNT, req->count);
+	outb(ATA_PIO_PORT_LBA_LO, req->lba);
+	outb(ATA_PIO_PORT_LBA_MID, req->lba >> 8);
+	outb(ATA_PIO_PORT_LBA_HIGH, req->lba >> 16);
+	outb(ATA_PIO_PORT_DRIVE, ((req->lba >> 24) & 0x0F) | ATA_PIO_DRIVE_MASTER);
+	outb(ATA_PIO_PORT_COMMAND, command);
+
+	// The whole transfer completes with single interrupt
+	if (req->dma) {
+		outb(ide.bmdma + IDE_BM_COMMAND, bm_command | IDE_BM_COMMAND_START);
+		return 0;
+	}
+
+	// Device asks for the first block of write without interrupt
+	if (req->write) {
+		ide_delay();
+		if (ide_poll(true) != 0)
+			return -1;
+		ide_transfer(req);
+	}
+
+	return 0;
+}
+
+static void ide_complete(struct ide_request *req, int status)
+{
+	assert(ide.active == req);
+
+	ide.active = NULL;
+	req->status = status;
+
+	if (status == 0 && req->dma)
+		ide.stat.dma++;
+
+	if (status != 0)
+		ide.stat.errors++;
+	else if (req->write)
+		ide.stat.written += req->count;
+	else
+		ide.stat.read += req->count;
+
+	if (req->done != NULL)
+		req->done(req);
+}
+
+// C-LOOK elevator: requests are served in ascending lba order starting
+// from the current head position, then head returns to the lowest lba.
+static struct ide_request *ide_pick(void)
+{
+	struct ide_request *req;
+
+	TAILQ_FOREACH(req, &ide.queue, link) {
+		if (req->lba >= ide.head)
+			return req;
+	}
+
+	return TAILQ_FIRST(&ide.queue);
+}
+
+static void ide_start(void)
+{
+	struct ide_request *req;
+
+	while (ide.active == NULL && (req = ide_pick()) != NULL) {
+		TAILQ_REMOVE(&ide.queue, req, link);
+
+		ide.active = req;
+		ide.head = req->lba + req->count;
+
+		if (ide_command(req) != 0)
+			ide_complete(req, -1);
+	}
+}
+
+// Queues request, its `done' callback is called on completion. Must be
+// called under kernel lock.
+int ide_submit(struct ide_request *req)
+{
+	struct ide_request *next;
+
+	if (ide.present == false || req->count == 0 || req->count > ATA_SECTORS_MAX ||
+	    req->count > ide.size || req->lba > ide.size - req->count)
+		return -1;
+
+	req->left = req->count;
+	req->status = 0;
+
+	TAILQ_FOREACH(next, &ide.queue, link) {
+		if (next->lba > req->lba)
+			break;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, req, link);
+	else
+		TAILQ_INSERT_TAIL(&ide.queue, req, link);
+	ide.stat.requests++;
+
+	ide_start();
+
+	return 0;
+}
+
+void ide_handler(struct task *task)
+{
+	struct ide_request *req = ide.active;
+	// Reading status acknowledges interrupt
+	uint8_t status = inb(ATA_PIO_PORT_STATUS);
+
+	ide.stat.interrupts++;
+
+	if (req != NULL && req->dma) {
+		uint8_t bm_status = inb(ide.bmdma + IDE_BM_STATUS);
+
+		outb(ide.bmdma + IDE_BM_COMMAND, 0);
+		outb(ide.bmdma + IDE_BM_STATUS, bm_status);
+
+		req->left = 0;
+		if ((status & (ATA_PIO_STATUS_ERR | ATA_PIO_STATUS_DF)) != 0 ||
+		    (bm_status & IDE_BM_STATUS_ERR) != 0)
+			ide_complete(req, -1);
+		else
+			ide_complete(req, 0);
+
+		ide_start();
+	} else if (req != NULL) {
+		if ((status & (ATA_PIO_STATUS_ERR | ATA_PIO_STATUS_DF)) != 0) {
+			ide_complete(req, -1);
+		} else if (req->write == false) {
+			ide_transfer(req);
+			if (req->left == 0)
+				ide_complete(req, 0);
+		} else if (req->left != 0) {
+			ide_transfer(req);
+		} else {
+			// The last block is written
+			ide_complete(req, 0);
+		}
+
+		ide_start();
+	}
+
+	APIC_WRITE(APIC_OFFSET_EOI, 0); // send EOI
+
+	if (task->state == TASK_STATE_READY)
+		task_run(task);
+
+	schedule();
+}
+
+void ide_stat(void)
+{
+	if (ide.present == false)
+		return terminal_printf("no ata device\n");
+
+	terminal_printf("requests: %lu, queued: %s\n", ide.stat.requests,
+			TAILQ_EMPTY(&ide.queue) ? "no" : "yes");
+	terminal_printf("sectors read: %lu, written: %lu\n",
+			ide.stat.read, ide.stat.written);
+	terminal_printf("interrupts: %lu, errors: %lu, dma: %lu\n",
+			ide.stat.interrupts, ide.stat.errors, ide.stat.dma);
+}
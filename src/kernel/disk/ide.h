@@ -0,0 +1,38 @@
+#ifndef __IDE_H__
+#define __IDE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stdlib/queue.h"
+
+struct task;
+struct ide_request;
+
+typedef void (*ide_done_t)(struct ide_request *req);
+
+// Request is completed by interrupt handler, which may run on behalf of
+// any task, so `buf' must be accessible from any address space.
+struct ide_request {
+	uint32_t lba;		// the first sector
+	uint32_t count;		// sectors, up to `ATA_SECTORS_MAX'
+	bool write;
+	void *buf;
+
+	int status;		// 0 on success, -1 on error
+	ide_done_t done;	// called under kernel lock, may be NULL
+	void *arg;
+
+	uint32_t left;		// sectors to transfer
+	bool dma;		// transferred by bus master
+	TAILQ_ENTRY(ide_request) link;	// link in the elevator queue
+};
+
+int ide_init(void);
+void ide_handler(struct task *task);
+
+int ide_submit(struct ide_request *req);
+
+void ide_stat(void);
+
+#endif
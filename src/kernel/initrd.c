@@ -0,0 +1,115 @@
+#include "stdlib/string.h"
+
+#include "kernel/lib/memory/mmu.h"
+#include "kernel/lib/memory/layout.h"
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/initrd.h"
+#include "kernel/misc/util.h"
+#include "kernel/loader/config.h"
+
+// Archive isn't changed after boot, so no lock is needed
+static struct {
+	struct initrd_header *header;
+	uint32_t *slots;
+	struct initrd_file *files;
+} initrd;
+
+static int initrd_check(struct initrd_header *header, uint64_t size)
+{
+	uint64_t index_end = sizeof(*header) + header->slots * sizeof(uint32_t) +
+			     header->files * sizeof(struct initrd_file);
+	uint32_t *slots = (uint32_t *)(header + 1);
+	struct initrd_file *files;
+
+	if (header->magic != INITRD_MAGIC || header->size != size || index_end > size) {
+		terminal_printf("Can't use initrd: invalid header\n");
+		return -1;
+	}
+	if ((header->slots & (header->slots - 1)) != 0 || header->files >= header->slots) {
+		terminal_printf("Can't use initrd: invalid hash table\n");
+		return -1;
+	}
+
+	// Slot holds index of the file plus one
+	for (uint32_t i = 0; i < header->slots; i++) {
+		if (slots[i] > header->files) {
+			terminal_printf("Can't use initrd: invalid hash slot %u\n", i);
+			return -1;
+		}
+	}
+
+	files = (struct initrd_file *)(slots + header->slots);
+	for (uint32_t i = 0; i < header->files; i++) {
+		if (files[i].offset % PAGE_SIZE != 0 || files[i].offset < index_end ||
+		    (uint64_t)files[i].offset + files[i].size > size ||
+		    files[i].name[INITRD_NAME_MAX - 1] != '\0') {
+			terminal_printf("Can't use initrd: invalid file %u\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Loader passes archive location, its pages are never freed
+void initrd_init(void)
+{
+	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
+	struct initrd_header *header = config->initrd.ptr;
+
+	if (config->initrd_size == 0) {
+		terminal_printf("[INITRD] not found, no programs can be started\n");
+		return;
+	}
+	if (initrd_check(header, config->initrd_size) != 0)
+		return;
+
+	initrd.header = header;
+	initrd.slots = (uint32_t *)(header + 1);
+	initrd.files = (struct initrd_file *)(initrd.slots + header->slots);
+
+	terminal_printf("[INITRD] files: %u, size: %u Kb\n", header->files, header->size / 1024);
+}
+
+// Load factor is below 1/2, so probing stops at empty slot quickly
+const struct initrd_file *initrd_lookup(const char *name)
+{
+	uint32_t mask;
+
+	if (initrd.header == NULL)
+		return NULL;
+
+	mask = initrd.header->slots - 1;
+	for (uint32_t i = initrd_hash(name) & mask; initrd.slots[i] != 0; i = (i + 1) & mask) {
+		const struct initrd_file *file = &initrd.files[initrd.slots[i] - 1];
+
+		if (strncmp(file->name, name, INITRD_NAME_MAX) == 0)
+			return file;
+	}
+
+	return NULL;
+}
+
+// Data is page aligned and accessible through direct mapping
+uint8_t *initrd_data(const struct initrd_file *file)
+{
+	return (uint8_t *)initrd.header + file->offset;
+}
+
+bool initrd_contains(const void *p)
+{
+	const uint8_t *start = (uint8_t *)initrd.header;
+
+	return initrd.header != NULL && (const uint8_t *)p >= start &&
+	       (const uint8_t *)p < start + initrd.header->size;
+}
+
+void initrd_list(void)
+{
+	if (initrd.header == NULL)
+		return terminal_printf("initrd isn't loaded\n");
+
+	for (uint32_t i = 0; i < initrd.header->files; i++)
+		terminal_printf("%s\t%u\n", initrd.files[i].name, initrd.files[i].size);
+}
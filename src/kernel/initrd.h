@@ -0,0 +1,48 @@
+#ifndef __INITRD_H__
+#define __INITRD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Read-only archive with user programs (see `user/mkinitrd.pl'). Loader
+// reads it after the kernel, kernel keeps it in memory forever.
+#define INITRD_DISK_SECTOR	32768	// 16Mb
+#define INITRD_MAGIC		0x44525449U	// "ITRD" in little endian
+#define INITRD_NAME_MAX		32
+
+// Header is followed by `slots' hash table entries (index of the file
+// plus one, 0 if slot is empty) and by `files' file entries
+struct initrd_header {
+	uint32_t magic;		// must be equal to `INITRD_MAGIC'
+	uint32_t files;		// number of files
+	uint32_t slots;		// power of 2, always greater than `files'
+	uint32_t size;		// size of the whole archive
+};
+
+struct initrd_file {
+	char name[INITRD_NAME_MAX];	// null terminated
+	uint32_t offset;		// page aligned, from the archive start
+	uint32_t size;
+};
+
+// FNV-1a, names are placed by linear probing from this slot
+static inline uint32_t initrd_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (uint8_t)*name) * 16777619U;
+
+	return hash;
+}
+
+void initrd_init(void);
+
+const struct initrd_file *initrd_lookup(const char *name);
+uint8_t *initrd_data(const struct initrd_file *file);
+bool initrd_contains(const void *p);
+
+void initrd_list(void);
+
+#endif
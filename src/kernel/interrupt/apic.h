@@ -75,12 +75,23 @@
 // End of interrupt
 #define APIC_OFFSET_EOI		0x000000b0
 
+// Interrupt Command Register (used to send IPIs), write to the
+// low part sends IPI
+#define APIC_OFFSET_ICR_LOW	0x00000300
+#define APIC_OFFSET_ICR_HIGH	0x00000310
+
+#define APIC_ICR_INIT		(0x5 << 8)	// delivery mode: INIT
+#define APIC_ICR_STARTUP	(0x6 << 8)	// delivery mode: start up
+#define APIC_ICR_PENDING	(1 << 12)	// delivery status: send pending
+#define APIC_ICR_ASSERT		(1 << 14)
+#define APIC_ICR_ALL_BUT_SELF	(0x3 << 18)	// destination shorthand
+
 #define APIC_READ(reg_off) ({				\
-	*(uint32_t *)(APIC_BASE + reg_off);		\
+	*(volatile uint32_t *)(APIC_BASE + reg_off);		\
 })
 
 #define APIC_WRITE(reg_off, val) {			\
-	*(uint32_t *)(APIC_BASE + reg_off) = val;	\
+	*(volatile uint32_t *)(APIC_BASE + reg_off) = val;	\
 }
 
 #endif
@@ -11,6 +11,7 @@
 #include "kernel/lib/console/terminal.h"
 
 #include "kernel/asm.h"
+#include "kernel/vma.h"
 #include "kernel/task.h"
 #include "kernel/syscall.h"
 #include "kernel/misc/tss.h"
@@ -23,6 +24,7 @@
 #include "kernel/interrupt/interrupt.h"
 #include "kernel/interrupt/timer.h"
 #include "kernel/interrupt/keyboard.h"
+#include "kernel/disk/ide.h"
 
 // interrupt handler entry points
 void interrupt_handler_div_by_zero();
@@ -46,7 +48,10 @@ void interrupt_handler_simd_fp();
 void interrupt_handler_security_exception();
 void interrupt_handler_timer();
 void interrupt_handler_keyboard();
+void interrupt_handler_ata();
 void interrupt_handler_syscall();
+void interrupt_handler_reschedule();
+void interrupt_handler_spurious();
 
 static struct descriptor64 idt[256];
 
@@ -75,7 +80,10 @@ static const char *interrupt_name[256] = {
 	[INTERRUPT_VECTOR_SECURITY_EXCEPTION] = "security exception",
 	[INTERRUPT_VECTOR_TIMER] = "timer",
 	[INTERRUPT_VECTOR_KEYBOARD] = "keyboard",
+	[INTERRUPT_VECTOR_ATA] = "ata",
 	[INTERRUPT_VECTOR_SYSCALL] = "syscall",
+	[INTERRUPT_VECTOR_RESCHEDULE] = "reschedule",
+	[INTERRUPT_VECTOR_SPURIOUS] = "spurious",
 };
 
 #define PAGE_FAULT_ERROR_CODE_P		(1 << 0)
@@ -83,33 +91,127 @@ static const char *interrupt_name[256] = {
 #define PAGE_FAULT_ERROR_CODE_U_S	(1 << 2)
 #define PAGE_FAULT_ERROR_CODE_RSV	(1 << 3)
 #define PAGE_FAULT_ERROR_CODE_I_D	(1 << 4)
+
+// Copy-on-write faults, changed under kernel lock
+static struct {
+	uint64_t copied;	// page was copied
+	uint64_t reused;	// last user of the page just made it writable
+	uint64_t tables;	// only shared page tables were copied
+} page_fault_cow_stat;
+
+void page_fault_stat(void)
+{
+	terminal_printf("copy-on-write faults: copied: %lu, reused: %lu, page tables only: %lu\n",
+			page_fault_cow_stat.copied, page_fault_cow_stat.reused,
+			page_fault_cow_stat.tables);
+}
+
+// Write fault inside 2Mb page, returns only if fault can't be fixed
+static void page_fault_large(struct task *task, uintptr_t va)
+{
+	struct page *old, *new;
+	unsigned perm;
+	pde_t *pde;
+
+	// Make page tables private first
+	if ((pde = mmap_lookup_pde(task->pml4, va, true)) == NULL)
+		return;
+
+	if ((*pde & PDE_W) != 0) {
+		page_fault_cow_stat.tables++;
+		task_run(task);
+	}
+
+	if ((*pde & PDE_COW) == 0)
+		return;
+
+	old = pa2page(LARGE_PAGE_ADDR(*pde));
+	if (__atomic_load_n(&old->ref, __ATOMIC_ACQUIRE) == 1) {
+		*pde = (*pde | PDE_W) & ~PDE_COW;
+		page_fault_cow_stat.reused++;
+
+		task_run(task);
+	}
+
+	if ((new = page_alloc_order(LARGE_PAGE_ORDER)) == NULL) {
+		terminal_printf("page_fault_handler: can't allocate large page\n");
+		return;
+	}
+
+	memcpy(page2kva(new), page2kva(old), LARGE_PAGE_SIZE);
+	perm = ((*pde & PTE_FLAGS_MASK) | PDE_W) & ~(PDE_COW | PDE_PS);
+	if (page_insert_large(task->pml4, new, ROUND_DOWN(va, LARGE_PAGE_SIZE), perm) != 0) {
+		page_free(new);
+		return;
+	}
+	page_fault_cow_stat.copied++;
+
+	task_run(task);
+}
+
 void page_fault_handler(struct task *task)
 {
 	uintptr_t va = rcr2();
+	pde_t *pde;
 	pte_t *pte;
 
+	// Page of user memory area wasn't populated yet
+	if ((task->context.error_code & PAGE_FAULT_ERROR_CODE_P) == 0 &&
+	    (task->context.error_code & PAGE_FAULT_ERROR_CODE_U_S) != 0 && va < USER_TOP &&
+	    vma_fault(task, va, (task->context.error_code & PAGE_FAULT_ERROR_CODE_R_W) != 0) == 0)
+		task_run(task);
+
+	pde = mmap_lookup_pde(task->pml4, va, false);
+	if ((task->context.error_code & PAGE_FAULT_ERROR_CODE_R_W) != 0 &&
+	    pde != NULL && (*pde & PDE_P) != 0 && (*pde & PDE_PS) != 0 &&
+	    va < USER_TOP)
+		page_fault_large(task, va);
+
 	page_lookup(task->pml4, va, &pte); // to initialize `pte'
-	if ((task->context.error_code & PAGE_FAULT_ERROR_CODE_R_W) == 0 || pte == NULL)
+	if ((task->context.error_code & PAGE_FAULT_ERROR_CODE_R_W) == 0 ||
+	    pte == NULL || va >= USER_TOP)
 		// non write error
 		goto fail;
 
+	// Page tables may be shared copy-on-write after fork, make
+	// them private first
+	if ((pte = mmap_lookup(task->pml4, va, true)) == NULL)
+		goto fail;
+
+	if ((*pte & PTE_W) != 0) {
+		// Only page tables were shared
+		page_fault_cow_stat.tables++;
+		task_run(task);
+	}
+
 	if ((*pte & PTE_COW) != 0) {
-		unsigned perm = *pte & PTE_FLAGS_MASK;
-		struct page *new;
+		struct page *old = pa2page(PTE_ADDR(*pte)), *new;
+		uintptr_t page_va = ROUND_DOWN(va, PAGE_SIZE);
 
 		assert((*pte & PTE_P) != 0);
+
+		if (__atomic_load_n(&old->ref, __ATOMIC_ACQUIRE) == 1) {
+			// Other users have already copied the page or exited.
+			// Fault has dropped read only TLB entry itself.
+			*pte = (*pte | PTE_W) & ~PTE_COW;
+			page_fault_cow_stat.reused++;
+
+			task_run(task);
+		}
+
 		if ((new = page_alloc()) == NULL) {
 			terminal_printf("page_fault_handler: can't allocate page\n");
 			goto fail;
 		}
 
-		terminal_printf("page fault: va = %p, new page: %p\n", va, new);
-		if (page_insert(task->pml4, new, KERNEL_TEMP, perm | PTE_W) != 0)
-			goto fail;
-		memcpy((void *)KERNEL_TEMP, (void *)ROUND_DOWN(va, PAGE_SIZE), PAGE_SIZE);
-		if (page_insert(task->pml4, new, ROUND_DOWN(va, PAGE_SIZE), (*pte & PTE_FLAGS_MASK) | PTE_W) != 0)
+		// Both pages are accessible through direct mapping
+		memcpy(page2kva(new), page2kva(old), PAGE_SIZE);
+		if (page_insert(task->pml4, new, page_va,
+				((*pte & PTE_FLAGS_MASK) | PTE_W) & ~PTE_COW) != 0) {
+			page_free(new);
 			goto fail;
-		page_remove(task->pml4, KERNEL_TEMP);
+		}
+		page_fault_cow_stat.copied++;
 
 		task_run(task);
 	}
@@ -135,10 +237,18 @@ void interrupt_handler(struct task_context ctx)
 {
 	struct cpu_context *cpu = cpu_context();
 
+	kernel_lock();
+
+	if (cpu->task == cpu->idle)
+		cpu->idle_time += rdtsc() - cpu->idle_start;
+
 	// XXX: Interrups are disabled here, think twice before enable it,
 	// because they can modify `cpu' value (it may cause a lot of problems)
 	cpu->task->context = ctx;
-	cpu->task->state = TASK_STATE_READY;
+	// Kernel thread may go to sleep by `int3' (see `bcache_wait')
+	if (cpu->task->state != TASK_STATE_DONT_RUN &&
+	    cpu->task->state != TASK_STATE_SLEEP)
+		cpu->task->state = TASK_STATE_READY;
 
 	switch (ctx.interrupt_number) {
 	case INTERRUPT_VECTOR_BREAKPOINT: {
@@ -146,6 +256,11 @@ void interrupt_handler(struct task_context ctx)
 		if ((ctx.cs & GDT_DPL_U) != 0)
 			return task_run(cpu->task);
 
+		// Exiting kernel thread (see `thread_foo'), its stack
+		// isn't used anymore, handler runs on interrupt stack
+		if (cpu->task->killed)
+			task_destroy(cpu->task);
+
 		// Kernel thread task switch
 		return schedule();
 	}
@@ -175,6 +290,14 @@ void interrupt_handler(struct task_context ctx)
 		return timer_handler(cpu->task);
 	case INTERRUPT_VECTOR_KEYBOARD:
 		return keyboard_handler(cpu->task);
+	case INTERRUPT_VECTOR_ATA:
+		return ide_handler(cpu->task);
+	case INTERRUPT_VECTOR_RESCHEDULE:
+		APIC_WRITE(APIC_OFFSET_EOI, 0);
+		return schedule();
+	case INTERRUPT_VECTOR_SPURIOUS:
+		// Doesn't require EOI
+		return task_run(cpu->task);
 	}
 
 	terminal_printf("\nunhandled interrupt: %s (%u)\n",
@@ -213,40 +336,31 @@ int ioapic_init(void)
 	uint32_t ver = IOAPIC_READ(IOAPICVER);
 	terminal_printf("[IOAPIC] Maximum Redirection Entry: %u\n", (ver >> 16) + 1);
 
-	// timer
-	IOAPIC_WRITE(IOREDTBL_BASE, INTERRUPT_VECTOR_TIMER);
-	IOAPIC_WRITE(IOREDTBL_BASE+1, local_apic_id);
+	// Legacy timer stays masked, local APIC timer is used instead
 
 	// keyboard
 	IOAPIC_WRITE(IOREDTBL_BASE+2, INTERRUPT_VECTOR_KEYBOARD);
 	IOAPIC_WRITE(IOREDTBL_BASE+3, local_apic_id);
 
+	// primary ata channel (IRQ 14)
+	IOAPIC_WRITE(IOREDTBL_BASE+28, INTERRUPT_VECTOR_ATA);
+	IOAPIC_WRITE(IOREDTBL_BASE+29, local_apic_id);
+
 	return 0;
 }
 
 void apic_enable(void)
 {
-	// 0x1B - msr of local apic
-	// bit 11 - global enable/disable APIC flag
-	asm volatile(
-		"movl $0x1b, %ecx\n\t"
-		"rdmsr\n\t"
-		"btsl $11, %eax\n\t"
-		"wrmsr"
-	);
+	wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_FLAG_ENABLE);
+
+	// Application processors start with software disabled APIC
+	APIC_WRITE(APIC_OFFSET_SVR, APIC_SVR_ENABLE | INTERRUPT_VECTOR_SPURIOUS);
 }
 
 void interrupt_init(void)
 {
 	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
 	struct descriptor *gdt = config->gdt.ptr;
-	struct cpu_context *cpu = cpu_context();
-	struct idtr {
-		uint16_t limit;
-		void *base;
-	} __attribute__((packed)) idtr = {
-		sizeof(idt)-1, idt
-	};
 
 	// XXX: `INTERRUPT_GATE' used everywhere just to simplify code. So `interrupt_handler' shouldn't be reentrant.
 	idt[INTERRUPT_VECTOR_DIV_BY_ZERO] = INTERRUPT_GATE(GD_KT, interrupt_handler_div_by_zero, 0, IDT_DPL_S);
@@ -272,56 +386,69 @@ void interrupt_init(void)
 	// hardware interrups
 	idt[INTERRUPT_VECTOR_TIMER] = INTERRUPT_GATE(GD_KT, interrupt_handler_timer, 1, IDT_DPL_S);
 	idt[INTERRUPT_VECTOR_KEYBOARD] = INTERRUPT_GATE(GD_KT, interrupt_handler_keyboard, 1, IDT_DPL_S);
+	idt[INTERRUPT_VECTOR_ATA] = INTERRUPT_GATE(GD_KT, interrupt_handler_ata, 1, IDT_DPL_S);
+	idt[INTERRUPT_VECTOR_RESCHEDULE] = INTERRUPT_GATE(GD_KT, interrupt_handler_reschedule, 1, IDT_DPL_S);
+	idt[INTERRUPT_VECTOR_SPURIOUS] = INTERRUPT_GATE(GD_KT, interrupt_handler_spurious, 1, IDT_DPL_S);
 
 	// software interrupts
 	idt[INTERRUPT_VECTOR_SYSCALL] = INTERRUPT_GATE(GD_KT, interrupt_handler_syscall, 0, IDT_DPL_U);
 
-	// Load idt
-	asm volatile("lidt %0" :: "m" (idtr));
-
 	// Initialize tss
 	for (uint32_t idx = (GD_TSS >> 3), j = 0; j < CPU_MAX_CNT; idx += 2, j++) {
 		struct descriptor64 *gdt64_entry = (struct descriptor64 *)&gdt[idx];
 		*gdt64_entry = SEGMENT_TSS(&tss[j], sizeof(tss[j])-1, TYPE_AVAILABLE_TSS, TSS_DPL_S);
 	}
 
-	// Prepare stack for interrupts
-	for (uintptr_t addr = INTERRUPT_STACK_TOP - INTERRUPT_STACK_SIZE;
-	     addr < INTERRUPT_STACK_TOP; addr += PAGE_SIZE) {
-		struct page *page;
+	// We are going to use IO APIC, so we must disable PIC.
+	outb(PIC1_DATA, 0xff);
+	outb(PIC2_DATA, 0xff);
 
-		if ((page = page_alloc()) == NULL)
-			panic("not enough memory for interrup handler stack");
-		if (page_insert(cpu->pml4, page, addr, PTE_W) != 0)
-			panic("can't map stack for interrupt handler");
-	}
+	interrupt_init_cpu();
 
-	// Prepare stack for exceptions
-	for (uintptr_t addr = EXCEPTION_STACK_TOP - EXCEPTION_STACK_SIZE;
-	     addr < EXCEPTION_STACK_TOP; addr += PAGE_SIZE) {
+	if (ioapic_init() != 0)
+		panic("ioapic_init failed");
+}
+
+static void interrupt_map_stack(uintptr_t top, size_t size)
+{
+	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
+
+	for (uintptr_t addr = top - size; addr < top; addr += PAGE_SIZE) {
 		struct page *page;
 
 		if ((page = page_alloc()) == NULL)
 			panic("not enough memory for interrup handler stack");
-		if (page_insert(cpu->pml4, page, addr, PTE_W) != 0)
+		if (page_insert(config->pml4.ptr, page, addr, PTE_W) != 0)
 			panic("can't map stack for interrupt handler");
 	}
+}
 
-	// For now this os support only one processor, so we must initialize
-	// only one tss. If you want use more processors -- you should
-	// initialize tss for each one.
-	tss[0].rsp0 = EXCEPTION_STACK_TOP;
-	tss[0].ist1 = INTERRUPT_STACK_TOP;
-	ltr(GD_TSS);
+// Must be called by each cpu (after `interrupt_init')
+void interrupt_init_cpu(void)
+{
+	cpuid_t id = cpu_get_id();
+	struct idtr {
+		uint16_t limit;
+		void *base;
+	} __attribute__((packed)) idtr = {
+		sizeof(idt)-1, idt
+	};
 
-	// We are going to use IO APIC, so we must disable PIC.
-	outb(PIC1_DATA, 0xff);
-	outb(PIC2_DATA, 0xff);
+	// Load idt
+	asm volatile("lidt %0" :: "m" (idtr));
 
-	apic_enable();
+	// Prepare stacks for interrupts and exceptions
+	interrupt_map_stack(INTERRUPT_STACK_TOP(id), INTERRUPT_STACK_SIZE);
+	interrupt_map_stack(EXCEPTION_STACK_TOP(id), EXCEPTION_STACK_SIZE);
 
-	if (ioapic_init() != 0)
-		panic("ioapic_init failed");
+	tss[id].rsp0 = EXCEPTION_STACK_TOP(id);
+	tss[id].ist1 = INTERRUPT_STACK_TOP(id);
+	ltr(GD_TSS + id * sizeof(struct descriptor64));
+
+	// Fast system calls use the same stack as `int $INTERRUPT_VECTOR_SYSCALL'
+	syscall_init();
+
+	apic_enable();
 }
 
 void interrupt_enable(void)
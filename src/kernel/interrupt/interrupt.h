@@ -29,10 +29,17 @@
 
 #define INTERRUPT_VECTOR_TIMER			32
 #define INTERRUPT_VECTOR_KEYBOARD		33
+#define INTERRUPT_VECTOR_RESCHEDULE		35	// IPI
+#define INTERRUPT_VECTOR_ATA			36
+
+#define INTERRUPT_VECTOR_SPURIOUS		255
 
 #ifndef __ASSEMBLER__
 void interrupt_init(void);
+void interrupt_init_cpu(void);
 void interrupt_enable(void);
+
+void page_fault_stat(void);
 #endif
 
 #endif
@@ -1,27 +1,321 @@
+#include <cpuid.h>
+
+#include "stdlib/assert.h"
+
 #include "kernel/lib/console/terminal.h"
 
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/misc/util.h"
 #include "kernel/task.h"
 #include "kernel/interrupt/apic.h"
 #include "kernel/interrupt/timer.h"
 #include "kernel/interrupt/interrupt.h"
 
-#define TIMER_INITIAL_COUNT	60000000
-#define TIMER_PERIODIC		(1 << 17)
+// LVT timer modes
+#define TIMER_ONE_SHOT		(0 << 17)
+#define TIMER_TSC_DEADLINE	(2 << 17)
+#define TIMER_MASKED		(1 << 16)
+
+// PIT channel 2 is used to calibrate local APIC timer and tsc
+#define PIT_FREQUENCY		1193182
+#define PIT_CHANNEL2		0x42
+#define PIT_COMMAND		0x43
+#define PIT_GATE		0x61	// bit 0 - gate, bit 5 - channel 2 output
+#define PIT_CALIBRATE_MS	10
+
+// Task runs at most this time, if other tasks are ready
+#define TIMER_SLICE_MS		20
+
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+
+static uint64_t timer_apic_hz;
+static uint64_t timer_tsc_hz;
+static uint64_t timer_tsc_base;	// tsc at clock start
+static uint64_t timer_tick;	// in tsc cycles
+static uint64_t timer_slice;	// in tsc cycles
+static bool timer_tsc_deadline;
+
+// Counts ticks of local APIC timer and tsc during `PIT_CALIBRATE_MS'
+static void timer_calibrate(void)
+{
+	uint16_t count = PIT_FREQUENCY * PIT_CALIBRATE_MS / 1000;
+	uint64_t tsc;
+	uint32_t apic;
+	uint8_t gate;
+
+	// Disable speaker, program channel 2 in mode 0 (interrupt on
+	// terminal count), gate starts counting
+	gate = inb(PIT_GATE) & ~0x3;
+	outb(PIT_GATE, gate);
+	outb(PIT_COMMAND, 0xb0);
+	outb(PIT_CHANNEL2, count & 0xff);
+	outb(PIT_CHANNEL2, count >> 8);
+
+	APIC_WRITE(APIC_OFFSET_DCR, APIC_DCR_NODIV);
+	APIC_WRITE(APIC_OFFSET_LVT_TIMER, TIMER_MASKED | TIMER_ONE_SHOT);
 
+	outb(PIT_GATE, gate | 0x1);
+	APIC_WRITE(APIC_OFFSET_ICR, UINT32_MAX);
+	tsc = rdtsc();
+
+	while ((inb(PIT_GATE) & 0x20) == 0)
+		pause();
+
+	apic = UINT32_MAX - APIC_READ(APIC_OFFSET_CCR);
+	tsc = rdtsc() - tsc;
+
+	APIC_WRITE(APIC_OFFSET_ICR, 0);
+	outb(PIT_GATE, gate);
+
+	timer_apic_hz = (uint64_t)apic * 1000 / PIT_CALIBRATE_MS;
+	timer_tsc_hz = tsc * 1000 / PIT_CALIBRATE_MS;
+	timer_tsc_base = rdtsc();
+	timer_tick = timer_tsc_hz * TIMER_TICK_MS / 1000;
+	timer_slice = timer_tsc_hz * TIMER_SLICE_MS / 1000;
+
+	terminal_printf("timer: apic %lu Hz, tsc %lu Hz, tsc deadline: %s\n",
+			timer_apic_hz, timer_tsc_hz, timer_tsc_deadline ? "yes" : "no");
+}
+
+// Must be called by each cpu, the first call calibrates timer
 int timer_init(void)
 {
-	APIC_WRITE(APIC_OFFSET_ICR, TIMER_INITIAL_COUNT);
+	struct cpu_context *cpu = cpu_context();
+	uint32_t mode;
+
+	if (timer_tsc_hz == 0) {
+		// TSC deadline mode - ecx[24]
+		uint32_t eax, ebx, ecx, edx;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0)
+			timer_tsc_deadline = (ecx & (1 << 24)) != 0;
+
+		timer_calibrate();
+		if (timer_apic_hz == 0 || timer_tsc_hz == 0) {
+			terminal_printf("Can't calibrate timer\n");
+			return -1;
+		}
+	}
+
+	// Timer is armed only when needed (see `timer_update')
+	mode = timer_tsc_deadline ? TIMER_TSC_DEADLINE : TIMER_ONE_SHOT;
 	APIC_WRITE(APIC_OFFSET_DCR, APIC_DCR_NODIV);
-	APIC_WRITE(APIC_OFFSET_LVT_TIMER, TIMER_PERIODIC | INTERRUPT_VECTOR_TIMER);
+	APIC_WRITE(APIC_OFFSET_LVT_TIMER, mode | INTERRUPT_VECTOR_TIMER);
+	cpu->timer_deadline = 0;
+	cpu->slice_end = 0;
+
+	for (uint32_t i = 0; i < TIMER_WHEEL_LEVELS; i++)
+		for (uint32_t j = 0; j < TIMER_WHEEL_SLOTS; j++)
+			LIST_INIT(&cpu->timer_wheel.slots[i][j]);
 
 	return 0;
 }
 
+// Monotonic time in nanoseconds
+uint64_t timer_clock(void)
+{
+	uint64_t tsc = rdtsc() - timer_tsc_base;
+
+	// Split to avoid overflow
+	return tsc / timer_tsc_hz * 1000000000ull +
+		tsc % timer_tsc_hz * 1000000000ull / timer_tsc_hz;
+}
+
+static uint64_t timer_ticks(void)
+{
+	return (rdtsc() - timer_tsc_base) / timer_tick;
+}
+
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer_event *timer)
+{
+	uint64_t delta;
+	uint32_t level = 0;
+
+	if (timer->expires < wheel->now)
+		timer->expires = wheel->now;
+	delta = timer->expires - wheel->now;
+
+	// Timers beyond the top level stay there until cascade
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	uint32_t idx = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	LIST_INSERT_HEAD(&wheel->slots[level][idx], timer, link);
+}
+
+// Moves timers of the current slot of `level' (and higher levels
+// if needed) to the lower levels
+static void timer_wheel_cascade(struct timer_wheel *wheel)
+{
+	for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t idx = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+		struct timer_slot slot = LIST_HEAD_INITIALIZER(slot);
+		struct timer_event *timer;
+
+		// Take the whole slot, because timers may return into it
+		while ((timer = LIST_FIRST(&wheel->slots[level][idx])) != NULL) {
+			LIST_REMOVE(timer, link);
+			LIST_INSERT_HEAD(&slot, timer, link);
+		}
+		while ((timer = LIST_FIRST(&slot)) != NULL) {
+			LIST_REMOVE(timer, link);
+			timer_wheel_insert(wheel, timer);
+		}
+
+		if (idx != 0)
+			break;
+	}
+}
+
+// Calls callbacks of all timers up to tick `target'
+static void timer_wheel_run(struct timer_wheel *wheel, uint64_t target)
+{
+	for (; wheel->now <= target; wheel->now++) {
+		struct timer_slot *slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+		struct timer_event *timer;
+
+		if (wheel->cnt == 0) {
+			wheel->now = target + 1;
+			break;
+		}
+
+		if ((wheel->now & TIMER_WHEEL_MASK) == 0)
+			timer_wheel_cascade(wheel);
+
+		while ((timer = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(timer, link);
+			assert(timer->expires == wheel->now);
+
+			timer->wheel = NULL;
+			wheel->cnt--;
+			timer->func(timer->arg);
+		}
+	}
+}
+
+// Returns tick, when wheel must be processed next time (the
+// nearest expiration or cascade)
+static uint64_t timer_wheel_next(struct timer_wheel *wheel)
+{
+	if (wheel->cnt == 0)
+		return UINT64_MAX;
+
+	for (uint64_t tick = wheel->now; ; tick++) {
+		if ((tick & TIMER_WHEEL_MASK) == 0 ||
+		    LIST_FIRST(&wheel->slots[0][tick & TIMER_WHEEL_MASK]) != NULL)
+			return tick;
+	}
+}
+
+// Calls `func(arg)' after at least `ms' milliseconds (on the current
+// cpu with kernel lock held)
+void timer_add(struct timer_event *timer, uint64_t ms, timer_func_t func, void *arg)
+{
+	struct timer_wheel *wheel = &cpu_context()->timer_wheel;
+	uint64_t now = timer_ticks();
+
+	assert(timer->wheel == NULL);
+
+	// Wheel isn't processed, while there are no timers
+	if (wheel->cnt == 0)
+		wheel->now = now;
+
+	timer->expires = now + ROUND_UP(ms, TIMER_TICK_MS) / TIMER_TICK_MS + 1;
+	timer->func = func;
+	timer->arg = arg;
+	timer->wheel = wheel;
+
+	timer_wheel_insert(wheel, timer);
+	wheel->cnt++;
+}
+
+void timer_del(struct timer_event *timer)
+{
+	if (timer->wheel == NULL)
+		return;
+
+	LIST_REMOVE(timer, link);
+	timer->wheel->cnt--;
+	timer->wheel = NULL;
+}
+
+// Interrupt occurs at tsc `deadline' (or a bit later)
+static void timer_arm(uint64_t deadline)
+{
+	struct cpu_context *cpu = cpu_context();
+
+	cpu->timer_deadline = deadline;
+
+	if (timer_tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+	} else {
+		uint64_t now = rdtsc();
+		uint64_t ticks = 1;
+
+		if (deadline > now)
+			ticks = (deadline - now) * timer_apic_hz / timer_tsc_hz;
+		if (ticks == 0)
+			ticks = 1;
+
+		APIC_WRITE(APIC_OFFSET_ICR, ticks > UINT32_MAX ? UINT32_MAX : ticks);
+	}
+}
+
+static void timer_disarm(void)
+{
+	cpu_context()->timer_deadline = 0;
+
+	if (timer_tsc_deadline)
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	else
+		APIC_WRITE(APIC_OFFSET_ICR, 0);
+}
+
+// Called before returning into task: time slice is needed only if
+// other tasks are ready, so single task runs without interrupts
+// (until the nearest kernel timer)
+void timer_update(void)
+{
+	struct cpu_context *cpu = cpu_context();
+	uint64_t deadline = UINT64_MAX;
+	uint64_t next;
+
+	if (cpu->runq.cnt == 0) {
+		cpu->slice_end = 0;
+	} else {
+		if (cpu->slice_end == 0)
+			cpu->slice_end = rdtsc() + timer_slice;
+		deadline = cpu->slice_end;
+	}
+
+	if ((next = timer_wheel_next(&cpu->timer_wheel)) != UINT64_MAX)
+		deadline = MIN(deadline, timer_tsc_base + next * timer_tick);
+
+	if (deadline == UINT64_MAX) {
+		if (cpu->timer_deadline != 0)
+			timer_disarm();
+	} else if (deadline != cpu->timer_deadline) {
+		timer_arm(deadline);
+	}
+}
+
+// New task gets the whole time slice
+void timer_slice_reset(void)
+{
+	cpu_context()->slice_end = 0;
+}
+
 void timer_handler(struct task *task)
 {
+	struct cpu_context *cpu = cpu_context();
+
 	(void)task;
 
 	APIC_WRITE(APIC_OFFSET_EOI, 0); // send EOI
 
+	cpu->timer_deadline = 0;
+	timer_wheel_run(&cpu->timer_wheel, timer_ticks());
+
 	schedule();
 }
@@ -1,7 +1,48 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include <stdint.h>
+
+#include "stdlib/queue.h"
+
+// Granularity of kernel timers
+#define TIMER_TICK_MS		1
+
+// Hierarchical timer wheel: slot of level `i' covers `64^i' ticks.
+// Timers are moved to the lower level, when their slot comes (cascade).
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS	4
+
+typedef void (*timer_func_t)(void *arg);
+
+struct timer_event {
+	LIST_ENTRY(timer_event) link;
+	struct timer_wheel *wheel;	// NULL, if timer isn't pending
+	uint64_t expires;		// in ticks
+	timer_func_t func;
+	void *arg;
+};
+LIST_HEAD(timer_slot, timer_event);
+
+// One wheel per cpu, callbacks are called by that cpu
+struct timer_wheel {
+	uint64_t now;		// the next tick to process
+	uint32_t cnt;		// pending timers
+	struct timer_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+struct task;
+
 int timer_init(void);
 void timer_handler(struct task *task);
 
+void timer_update(void);
+void timer_slice_reset(void);
+
+uint64_t timer_clock(void);
+
+void timer_add(struct timer_event *timer, uint64_t ms, timer_func_t func, void *arg);
+void timer_del(struct timer_event *timer);
+
 #endif
@@ -7,9 +7,15 @@
 
 #include "kernel/asm.h"
 #include "kernel/cpu.h"
+#include "kernel/pci.h"
+#include "kernel/smp.h"
+#include "kernel/tlb.h"
 #include "kernel/task.h"
+#include "kernel/initrd.h"
 #include "kernel/thread.h"
 #include "kernel/monitor.h"
+#include "kernel/disk/ide.h"
+#include "kernel/disk/bcache.h"
 #include "kernel/loader/config.h"
 #include "kernel/interrupt/interrupt.h"
 
@@ -31,6 +37,9 @@ void kernel_panic(const char *fmt, ...)
 
 struct page32 {
 	uint32_t ref;
+	uint8_t order;
+	uint8_t flags;
+	uint16_t padding;
 	uint64_t links;
 } __attribute__((packed));
 
@@ -40,7 +49,9 @@ void kernel_init_mmap(void)
 	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
 	struct cpu_context *cpu = cpu_context();
 	static struct mmap_state state;
+	struct mmap_free_pages loader_free = LIST_HEAD_INITIALIZER(loader_free);
 	struct page32 *pages32;
+	struct page *p;
 	struct gdtr {
 		uint16_t limit;
 		uint64_t base;
@@ -50,13 +61,17 @@ void kernel_init_mmap(void)
 	config->gdt.ptr = VADDR(config->gdt.ptr);
 	config->pml4.ptr = VADDR(config->pml4.ptr);
 	config->pages.ptr = VADDR(config->pages.ptr);
+	if (config->initrd_size != 0)
+		config->initrd.ptr = VADDR(config->initrd.ptr);
 
 	cpu->pml4 = config->pml4.ptr;
 
 	// Reinitialize state
-	state.free = (struct mmap_free_pages){ NULL };
+	for (uint8_t i = 0; i < PAGE_ORDER_CNT; i++)
+		LIST_INIT(&state.free[i]);
 	state.pages_cnt = config->pages_cnt;
 	state.pages = config->pages.ptr;
+	state.cache = cpu_page_cache;
 	mmap_init(&state);
 
 	sgdt(gdtr);
@@ -69,14 +84,15 @@ void kernel_init_mmap(void)
 	pages32 = (struct page32 *)config->pages.ptr;
 	cpu->pml4[0] = 0; // remove unneeded mappings
 
-	// First of all - convert `page32' into 64-bit `page'.
-	// And rebuild free list
+	// First of all - convert `page32' into 64-bit `page' and collect
+	// free pages. Buddy lists can't be built here, because `page_free'
+	// looks at buddies, which may be not converted yet.
 	uint32_t used_pages = 0;
 	for (int64_t i = state.pages_cnt-1; i >= 0; i--) {
-		struct page *p = &state.pages[i];
 		uint64_t links = pages32[i].links;
 		uint32_t rc = pages32[i].ref;
 
+		p = &state.pages[i];
 		memset(p, 0, sizeof(*p));
 		p->ref = rc;
 
@@ -90,21 +106,20 @@ void kernel_init_mmap(void)
 
 		// Pages inside free list may has ref counter > 0, this means
 		// that page is used, but reuse is allowed.
-		LIST_INSERT_HEAD(&state.free, p, link);
+		LIST_INSERT_HEAD(&loader_free, p, link);
 		assert(p->ref <= 1);
 	}
 
-	terminal_printf("Pages stat: used: `%u', free: `%u'\n",
-			used_pages, state.pages_cnt - used_pages);
-}
+	// Now merge free pages into buddy blocks
+	while ((p = LIST_FIRST(&loader_free)) != NULL) {
+		LIST_REMOVE(p, link);
 
-// Just to demonstrate possible threads implementation
-void kernel_thread(void *arg __attribute__((unused)))
-{
-	while (1) {
-		// call schedule
-		asm volatile("int3");
+		p->ref = 0;
+		page_free_order(p, 0);
 	}
+
+	terminal_printf("Pages stat: used: `%u', free: `%u'\n",
+			used_pages, state.pages_cnt - used_pages);
 }
 
 void kernel_main(void)
@@ -113,6 +128,12 @@ void kernel_main(void)
 	extern uint8_t edata[], end[];
 	memset(edata, 0, end - edata);
 
+	// Select string functions implementation
+	string_init();
+
+	// Bootstrap processor becomes cpu `0'
+	cpu_register();
+
 	// Reset terminal
 	terminal_init();
 
@@ -122,12 +143,29 @@ void kernel_main(void)
 	// Initialize memory (process info prepared by loader)
 	kernel_init_mmap();
 
+	// Enable global pages and PCID
+	tlb_init_cpu();
+
+	// User programs are started from archive loaded by loader
+	initrd_init();
+
 	// Initialize tasks free list
 	task_init();
 
 	// Init interrupts and exceptions.
 	interrupt_init();
 
+	// Find devices, before their drivers are initialized
+	pci_init();
+
+	// Disk requests are completed by interrupts
+	ide_init();
+	bcache_init();
+
+	// Start other processors, they take kernel lock on their own
+	smp_init();
+	kernel_lock();
+
 	//TASK_STATIC_INITIALIZER(hello);
 
 	//TASK_STATIC_INITIALIZER(read_kernel);
@@ -139,14 +177,12 @@ void kernel_main(void)
 	//TASK_STATIC_INITIALIZER(fork);
 	TASK_STATIC_INITIALIZER(spin);
 	//TASK_STATIC_INITIALIZER(exit);
+	//TASK_STATIC_INITIALIZER(sleep);
+	//TASK_STATIC_INITIALIZER(spawn);
+	//TASK_STATIC_INITIALIZER(mmap);
 
-	struct task *thread = thread_create("scheduler", kernel_thread, NULL, 0);
-	if (thread == NULL)
-		panic("can't create kernel thread");
-	thread_run(thread);
-
-	// Do it after creating tasks, because timer may
-	// panic if no tasks found.
+	// Do it after creating tasks, so the first tick
+	// doesn't go to the idle task
 	interrupt_enable();
 
 	schedule();
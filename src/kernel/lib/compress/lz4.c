@@ -0,0 +1,71 @@
+#include "stdlib/string.h"
+
+#include "kernel/misc/util.h"
+#include "kernel/lib/compress/lz4.h"
+
+#define LZ4_LENGTH_MORE		15	// length continues in the next bytes
+#define LZ4_MATCH_MIN		4
+
+// Adds bytes of extended length, returns -1 if input ends
+static int lz4_read_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint8_t byte;
+
+	do {
+		if (*ip == iend)
+			return -1;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+// Decompresses single block, see lz4 block format description. Output
+// is truncated to `dst_size' bytes, decompression also stops where input
+// ends, so the beginning of the block may be decoded from its prefix.
+// Returns number of decompressed bytes or -1 if block is corrupted.
+int32_t lz4_decompress(const void *src, uint32_t src_size, void *dst, uint32_t dst_size)
+{
+	const uint8_t *ip = src, *iend = ip + src_size;
+	uint8_t *op = dst, *oend = op + dst_size;
+
+	while (ip < iend && op < oend) {
+		uint32_t literals = *ip >> 4;
+		uint32_t match = (*ip++ & 0xF) + LZ4_MATCH_MIN;
+		uint32_t offset;
+
+		if (literals == LZ4_LENGTH_MORE && lz4_read_length(&ip, iend, &literals) != 0)
+			break;
+		literals = MIN(literals, (uint32_t)(iend - ip));
+		literals = MIN(literals, (uint32_t)(oend - op));
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has only literals
+		if (iend - ip < 2 || op == oend)
+			break;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (uint32_t)(op - (uint8_t *)dst))
+			return -1;
+
+		if (match == LZ4_LENGTH_MORE + LZ4_MATCH_MIN &&
+		    lz4_read_length(&ip, iend, &match) != 0)
+			break;
+		match = MIN(match, (uint32_t)(oend - op));
+
+		if (offset >= match) {
+			memcpy(op, op - offset, match);
+			op += match;
+		} else {
+			// Overlapped copy repeats the last `offset' bytes
+			for (; match != 0; match--, op++)
+				*op = *(op - offset);
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,20 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#ifdef __USER__
+# error "This file is for kernel internal use only"
+#endif
+
+#include <stdint.h>
+
+// Legacy frame (`lz4 -l'): magic, then blocks, each one is prefixed by
+// its compressed size and decompressed independently of others
+#define LZ4_LEGACY_MAGIC	0x184C2102U
+#define LZ4_LEGACY_BLOCK_SIZE	(8 << 20)	// max decompressed block size
+
+// Compressed size of incompressible data
+#define LZ4_COMPRESS_BOUND(size_)	((size_) + (size_) / 255 + 16)
+
+int32_t lz4_decompress(const void *src, uint32_t src_size, void *dst, uint32_t dst_size);
+
+#endif
@@ -1,6 +1,7 @@
 #include "stdlib/string.h"
 #include "stdlib/assert.h"
 
+#include "kernel/lib/sync/spinlock.h"
 #include "kernel/lib/memory/layout.h"
 #include "kernel/lib/console/terminal.h"
 
@@ -12,6 +13,10 @@ static uint8_t terminal_color;
 static size_t terminal_column;
 static size_t terminal_row;
 
+// Protects output position and buffer (but lines printed by
+// different cpus at the same time may be mixed)
+static struct spinlock terminal_lock;
+
 struct terminal_position terminal_position(void)
 {
 	return (struct terminal_position) {
@@ -68,14 +73,14 @@ uint8_t terminal_make_color(enum terminal_color fg, enum terminal_color bg)
 }
 
 #define TERMINAL_TAB_SPACE	8
-void terminal_put_color(uint8_t ch, uint8_t color)
+static void terminal_put_char(uint8_t ch, uint8_t color)
 {
 	size_t index = terminal_row*TERMINAL_COL_COUNT + terminal_column;
 
 	switch (ch) {
 	case '\t':
 		for (uint8_t i = 0; i < TERMINAL_TAB_SPACE; i++)
-			terminal_put_color(' ', color);
+			terminal_put_char(' ', color);
 
 		return;
 	case '\r':
@@ -111,12 +116,17 @@ void terminal_put_color(uint8_t ch, uint8_t color)
 	}
 }
 
-void terminal_put(uint8_t ch)
+void terminal_put_color(uint8_t ch, uint8_t color)
 {
-	// Disable interrupts, because `terminal_put_color'
-	// is not reenterant. Interrupts will be enabled on task switch.
-	asm volatile ("cli");
+	uintptr_t flags;
 
+	flags = spin_lock_irqsave(&terminal_lock);
+	terminal_put_char(ch, color);
+	spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+void terminal_put(uint8_t ch)
+{
 	terminal_put_color(ch, terminal_color);
 }
 
@@ -262,5 +272,6 @@ void terminal_clear(void)
 
 void terminal_init(void)
 {
+	spinlock_init(&terminal_lock, "terminal");
 	terminal_clear();
 }
@@ -8,8 +8,72 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "kernel/asm.h"
+
 #define ATA_SECTOR_SIZE		512
 
+// see http://wiki.osdev.org/ATA_PIO_Mode
+#define ATA_PIO_PORT_DATA	0x1F0
+#define ATA_PIO_PORT_ERROR	0x1F1
+#define ATA_PIO_PORT_SECT_CNT	0x1F2
+#define ATA_PIO_PORT_LBA_LO	0x1F3
+#define ATA_PIO_PORT_LBA_MID	0x1F4
+#define ATA_PIO_PORT_LBA_HIGH	0x1F5
+#define ATA_PIO_PORT_DRIVE	0x1F6
+#define ATA_PIO_PORT_STATUS	0x1F7
+#define ATA_PIO_PORT_COMMAND	0x1F7
+#define ATA_PIO_PORT_CONTROL	0x3F6
+
+#define ATA_PIO_CMD_READ	0x20
+#define ATA_PIO_CMD_READ_EXT	0x24	// LBA48
+#define ATA_PIO_CMD_WRITE	0x30
+#define ATA_PIO_CMD_READ_MULTIPLE	0xC4
+#define ATA_PIO_CMD_WRITE_MULTIPLE	0xC5
+#define ATA_PIO_CMD_SET_MULTIPLE	0xC6
+#define ATA_PIO_CMD_READ_DMA	0xC8
+#define ATA_PIO_CMD_WRITE_DMA	0xCA
+#define ATA_PIO_CMD_IDENTIFY	0xEC
+
+#define ATA_PIO_DRIVE_MASTER	0xE0
+
+// Indicates an error occurred
+#define ATA_PIO_STATUS_ERR	(1 << 0)
+// Drive Fault Error (does not set ERR)
+#define ATA_PIO_STATUS_DF	(1 << 5)
+// Indicates the drive is preparing to send/receive data (wait for it to clear).
+#define ATA_PIO_STATUS_BSY	(1 << 7)
+// Bit is clear when drive is spun down, or after an error. Set otherwise.
+#define ATA_PIO_STATUS_RDY	(1 << 6)
+// Set when the drive has PIO data to transfer, or is ready to accept PIO data.
+#define ATA_PIO_STATUS_DRQ	(1 << 3)
+
+// Set to stop the current device from sending interrupts
+#define ATA_PIO_CONTROL_NIEN	(1 << 1)
+
+// One command transfers up to 256 sectors (sector count 0 means 256)
+#define ATA_SECTORS_MAX		256
+
+// LBA28 commands address the first 128Gb
+#define ATA_LBA28_LIMIT		(1ull << 28)
+
+// Waits until device isn't busy, `drq' - device must have data to transfer
+static inline int8_t disk_io_wait_ready(bool drq)
+{
+	while (1) {
+		uint8_t status = inb(ATA_PIO_PORT_STATUS);
+
+		if ((status & (ATA_PIO_STATUS_ERR | ATA_PIO_STATUS_DF)) != 0)
+			return -1;
+		if ((status & ATA_PIO_STATUS_BSY) != 0)
+			continue;
+		if (drq == true && (status & ATA_PIO_STATUS_DRQ) == 0)
+			continue;
+		if ((status & ATA_PIO_STATUS_RDY) != 0)
+			return 0;
+	}
+}
+
 int8_t disk_io_read_segment(uintptr_t va, uint32_t size, uint32_t lba);
+int8_t disk_io_read_sectors(void *dst, uint64_t lba, uint32_t count);
 
 #endif
@@ -0,0 +1,50 @@
+#include "kernel/asm.h"
+#include "kernel/lib/disk/ata.h"
+
+// Kept apart from `ata.c', because boot sector has no room for it
+
+// Reads up to `ATA_SECTORS_MAX' sectors by single command. Device
+// raises DRQ for each sector. LBA48 command is used only when sectors
+// lie above the LBA28 limit.
+int8_t disk_io_read_sectors(void *dst, uint64_t lba, uint32_t count)
+{
+	uint16_t *p = dst;
+
+	if (count == 0 || count > ATA_SECTORS_MAX)
+		return -1;
+
+	if (disk_io_wait_ready(false) != 0)
+		return -1;
+
+	if (lba + count <= ATA_LBA28_LIMIT) {
+		// Sector count 0 means 256 sectors
+		outb(ATA_PIO_PORT_SECT_CNT, count);
+		outb(ATA_PIO_PORT_LBA_LO, lba);
+		outb(ATA_PIO_PORT_LBA_MID, lba >> 8);
+		outb(ATA_PIO_PORT_LBA_HIGH, lba >> 16);
+		outb(ATA_PIO_PORT_DRIVE, ((lba >> 24) & 0x0F) | ATA_PIO_DRIVE_MASTER);
+		outb(ATA_PIO_PORT_COMMAND, ATA_PIO_CMD_READ);
+	} else {
+		// High order bytes are written first
+		outb(ATA_PIO_PORT_DRIVE, ATA_PIO_DRIVE_MASTER);
+		outb(ATA_PIO_PORT_SECT_CNT, count >> 8);
+		outb(ATA_PIO_PORT_LBA_LO, lba >> 24);
+		outb(ATA_PIO_PORT_LBA_MID, lba >> 32);
+		outb(ATA_PIO_PORT_LBA_HIGH, lba >> 40);
+		outb(ATA_PIO_PORT_SECT_CNT, count);
+		outb(ATA_PIO_PORT_LBA_LO, lba);
+		outb(ATA_PIO_PORT_LBA_MID, lba >> 8);
+		outb(ATA_PIO_PORT_LBA_HIGH, lba >> 16);
+		outb(ATA_PIO_PORT_COMMAND, ATA_PIO_CMD_READ_EXT);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (disk_io_wait_ready(true) != 0)
+			return -1;
+
+		insw(ATA_PIO_PORT_DATA, p, ATA_SECTOR_SIZE / sizeof(uint16_t));
+		p += ATA_SECTOR_SIZE / sizeof(uint16_t);
+	}
+
+	return 0;
+}
@@ -19,26 +19,40 @@
 #define APIC_BASE		(KERNEL_INFO - PAGE_SIZE)
 #define IOAPIC_BASE		(APIC_BASE - PAGE_SIZE)
 
+// Temporary page is shared by all processors, so it may be used
+// only under kernel lock
+#define KERNLE_TEMP_PAGE_CNT	(1)
+#define KERNEL_TEMP		(IOAPIC_BASE - KERNLE_TEMP_PAGE_CNT*PAGE_SIZE)
+
 // Separate stack for interrupts (using IST),
-// because otherwise they may override stack of kernel threads
+// because otherwise they may override stack of kernel threads.
+// Each cpu has its own pair of interrupt and exception stacks,
+// pairs are separated by unmapped guard page.
 #define INTERRUPT_STACK_SIZE	(PAGE_SIZE * 2)
-#define INTERRUPT_STACK_TOP	(IOAPIC_BASE)
-
 #define EXCEPTION_STACK_SIZE	(PAGE_SIZE * 2)
-#define EXCEPTION_STACK_TOP	(INTERRUPT_STACK_TOP - INTERRUPT_STACK_SIZE)
+#define CPU_STACKS_SIZE		(INTERRUPT_STACK_SIZE + EXCEPTION_STACK_SIZE + PAGE_SIZE)
 
-// It is good idea to make at least one temporary page for each
-// processor. But for now we use only one procesor, so one page
-// should be enough.
-#define KERNLE_TEMP_PAGE_CNT	(1)
-#define KERNEL_TEMP		(EXCEPTION_STACK_TOP - EXCEPTION_STACK_SIZE - KERNLE_TEMP_PAGE_CNT*PAGE_SIZE)
+#define INTERRUPT_STACK_TOP(cpu_id_)	(KERNEL_TEMP - PAGE_SIZE - (cpu_id_) * CPU_STACKS_SIZE)
+#define EXCEPTION_STACK_TOP(cpu_id_)	(INTERRUPT_STACK_TOP(cpu_id_) - INTERRUPT_STACK_SIZE)
 
 // Physical address of the APIC base
 #define APIC_BASE_PA	0xFEE00000
 // Physical address of the IO APIC base
 #define IOAPIC_BASE_PA	0xFEC00000
 
+// Application processors start here (in real mode, so it must be
+// below 1Mb). Area contains code, page tables and stack.
+#define SMP_TRAMPOLINE_PA	0x8000
+#define SMP_TRAMPOLINE_SIZE	(PAGE_SIZE * 6)
+
 #define USER_TOP	0x0000010000000000	// 1 TB
 #define USER_STACK_TOP	0x0000000a00000000
 
+// Stack area grows on demand up to this size
+#define USER_STACK_SIZE_MAX	(PAGE_SIZE * 2048)
+
+// Anonymous areas created by `sys_mmap'
+#define USER_MMAP_BASE	0x0000000100000000
+#define USER_MMAP_TOP	(USER_STACK_TOP - USER_STACK_SIZE_MAX)
+
 #endif
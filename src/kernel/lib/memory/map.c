@@ -13,42 +13,335 @@ static struct mmap_state *mmap_state;
 void mmap_init(struct mmap_state *state)
 {
 	mmap_state = state;
+
+	spinlock_init(&state->lock, "buddy");
+	spinlock_init(&state->zeroed.lock, "zeroed pool");
+}
+
+static void page_buddy_insert(struct page *p, uint8_t order)
+{
+	p->order = order;
+	p->flags |= PAGE_FLAG_FREE;
+
+	LIST_INSERT_HEAD(&mmap_state->free[order], p, link);
+	mmap_state->stat[order].free++;
+}
+
+static void page_buddy_remove(struct page *p, uint8_t order)
+{
+	assert((p->flags & PAGE_FLAG_FREE) != 0 && p->order == order);
+
+	LIST_REMOVE(p, link);
+	p->flags &= ~PAGE_FLAG_FREE;
+	mmap_state->stat[order].free--;
+}
+
+// Must be called under `mmap_state->lock'
+static struct page *page_buddy_alloc(uint8_t order)
+{
+	struct page *p = NULL;
+	uint8_t o;
+
+	assert(order <= PAGE_ORDER_MAX);
+
+	// Find the smallest free block, which is large enough
+	for (o = order; o <= PAGE_ORDER_MAX; o++) {
+		if ((p = LIST_FIRST(&mmap_state->free[o])) != NULL)
+			break;
+	}
+
+	if (p == NULL) {
+		mmap_state->stat[order].fail++;
+		return NULL;
+	}
+
+	LIST_REMOVE(p, link);
+	mmap_state->stat[o].free--;
+
+	// Split block, second halves go back into free lists
+	while (o > order) {
+		o--;
+		page_buddy_insert(p + (1ull << o), o);
+	}
+
+	// XXX: set to `NULL' is important. Because kernel think
+	// that page is free only if it has NULL links
+	memset(p, 0, sizeof(*p) << order);
+	p->order = order;
+
+	mmap_state->stat[order].alloc++;
+
+	return p;
+}
+
+// Must be called under `mmap_state->lock'
+static void page_buddy_free(struct page *p, uint8_t order)
+{
+	uint64_t idx = p - mmap_state->pages;
+
+	assert(p->ref == 0);
+	assert((p->flags & PAGE_FLAG_FREE) == 0);
+	assert(order <= PAGE_ORDER_MAX);
+	assert((idx & ((1ull << order) - 1)) == 0);
+
+	// Merge block with its buddy while buddy is free too
+	while (order < PAGE_ORDER_MAX) {
+		uint64_t buddy_idx = idx ^ (1ull << order);
+		struct page *buddy = &mmap_state->pages[buddy_idx];
+
+		if (buddy_idx + (1ull << order) > mmap_state->pages_cnt)
+			break;
+		if ((buddy->flags & PAGE_FLAG_FREE) == 0 || buddy->order != order)
+			break;
+
+		page_buddy_remove(buddy, order);
+
+		idx &= ~(1ull << order);
+		order++;
+	}
+
+	page_buddy_insert(&mmap_state->pages[idx], order);
+}
+
+// Returns all cached pages back to buddy allocator, so they may be
+// merged. Must be called under `mmap_state->lock' on the cache owner.
+static void page_cache_drain(struct page_cache *cache)
+{
+	uint32_t cnt = cache->hot.cnt + cache->cold.cnt;
+
+	for (uint32_t i = 0; i < cache->hot.cnt; i++)
+		page_buddy_free(cache->hot.pages[i], 0);
+	for (uint32_t i = 0; i < cache->cold.cnt; i++)
+		page_buddy_free(cache->cold.pages[i], 0);
+	cache->hot.cnt = cache->cold.cnt = 0;
+
+	__atomic_sub_fetch(&mmap_state->cached, cnt, __ATOMIC_RELAXED);
+	cache->drains++;
+}
+
+struct page *page_alloc_order(uint8_t order)
+{
+	struct page *p;
+	uintptr_t flags;
+
+	flags = spin_lock_irqsave(&mmap_state->lock);
+	p = page_buddy_alloc(order);
+	if (p == NULL && order > 0 && mmap_state->cache != NULL) {
+		// Missing buddies may sit in magazines. Only the current cpu
+		// cache is drained, other ones hold a few pages each.
+		page_cache_drain(mmap_state->cache());
+		p = page_buddy_alloc(order);
+	}
+	spin_unlock_irqrestore(&mmap_state->lock, flags);
+
+	return p;
+}
+
+void page_free_order(struct page *p, uint8_t order)
+{
+	uintptr_t flags;
+
+	flags = spin_lock_irqsave(&mmap_state->lock);
+	page_buddy_free(p, order);
+	spin_unlock_irqrestore(&mmap_state->lock, flags);
+}
+
+static struct page *page_cache_get(struct page_cache *cache)
+{
+	struct page *p;
+	uint32_t cnt;
+
+	if (cache->hot.cnt > 0) {
+		p = cache->hot.pages[--cache->hot.cnt];
+		cache->hits++;
+	} else {
+		if (cache->cold.cnt == 0) {
+			// Refill cold magazine at once (buddy lock is taken
+			// once per batch)
+			spin_lock(&mmap_state->lock);
+			for (cnt = 0; cnt < PAGE_CACHE_BATCH; cnt++) {
+				if ((p = page_buddy_alloc(0)) == NULL)
+					break;
+
+				cache->cold.pages[cache->cold.cnt++] = p;
+			}
+			spin_unlock(&mmap_state->lock);
+
+			if (cache->cold.cnt == 0)
+				return NULL;
+			__atomic_add_fetch(&mmap_state->cached, cnt, __ATOMIC_RELAXED);
+
+			cache->refills++;
+		} else {
+			cache->hits++;
+		}
+
+		p = cache->cold.pages[--cache->cold.cnt];
+	}
+	__atomic_sub_fetch(&mmap_state->cached, 1, __ATOMIC_RELAXED);
+
+	memset(p, 0, sizeof(*p));
+
+	return p;
+}
+
+static void page_cache_put(struct page_cache *cache, struct page *p)
+{
+	struct page_magazine *hot = &cache->hot;
+
+	if (hot->cnt == PAGE_CACHE_SIZE) {
+		// Return the oldest (coldest) pages back to buddy allocator
+		spin_lock(&mmap_state->lock);
+		for (uint32_t i = 0; i < PAGE_CACHE_BATCH; i++)
+			page_buddy_free(hot->pages[i], 0);
+		spin_unlock(&mmap_state->lock);
+
+		__atomic_sub_fetch(&mmap_state->cached, PAGE_CACHE_BATCH, __ATOMIC_RELAXED);
+		hot->cnt -= PAGE_CACHE_BATCH;
+		for (uint32_t i = 0; i < hot->cnt; i++)
+			hot->pages[i] = hot->pages[i + PAGE_CACHE_BATCH];
+
+		cache->drains++;
+	}
+
+	hot->pages[hot->cnt++] = p;
+	__atomic_add_fetch(&mmap_state->cached, 1, __ATOMIC_RELAXED);
 }
 
 struct page *page_alloc(void)
 {
-	struct page *p = LIST_FIRST(&mmap_state->free);
+	struct page *p;
+	uintptr_t flags;
 
-	if (p != NULL) {
+	if (mmap_state->cache == NULL)
+		return page_alloc_order(0);
+
+	// Cache belongs to the current cpu, so it is enough to disable
+	// interrupts to protect it
+	flags = irq_save();
+	p = page_cache_get(mmap_state->cache());
+	irq_restore(flags);
+
+	return p;
+}
+
+// Free whole block, `p' must be the first page of the block
+void page_free(struct page *p)
+{
+	uintptr_t flags;
+
+	if (mmap_state->cache == NULL || p->order != 0) {
+		page_free_order(p, p->order);
+		return;
+	}
+
+	assert(p->ref == 0);
+
+	flags = irq_save();
+	page_cache_put(mmap_state->cache(), p);
+	irq_restore(flags);
+}
+
+// Takes page from the zeroed pool, falls back to synchronous zeroing
+struct page *page_alloc_zeroed(void)
+{
+	struct page_zeroed_pool *pool = &mmap_state->zeroed;
+	struct page *p;
+	uintptr_t flags;
+
+	flags = spin_lock_irqsave(&pool->lock);
+	if ((p = LIST_FIRST(&pool->pages)) != NULL) {
 		LIST_REMOVE(p, link);
+		pool->cnt--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
 
-		// XXX: set to `NULL' is important. Because kernel think
-		// that page is free only if it has NULL links
+	if (p != NULL) {
 		memset(p, 0, sizeof(*p));
+		return p;
 	}
 
+	if ((p = page_alloc()) == NULL)
+		return NULL;
+	memset(page2kva(p), 0, PAGE_SIZE);
+
 	return p;
 }
 
-void page_free(struct page *p)
+// Adds up to `cnt' zeroed pages into the pool, returns number of added
+// pages. Pages are zeroed with interrupts enabled, so this may be called
+// from a kernel thread without hurting interrupts latency.
+uint32_t page_zeroed_refill(uint32_t cnt)
 {
-	LIST_INSERT_HEAD(&mmap_state->free, p, link);
-	assert(p->ref == 0);
+	struct page_zeroed_pool *pool = &mmap_state->zeroed;
+	uint32_t added = 0;
+	uintptr_t flags;
+	struct page *p;
+
+	for (; added < cnt && pool->cnt < PAGE_ZEROED_MAX; added++) {
+		if ((p = page_alloc()) == NULL)
+			break;
+
+		memset(page2kva(p), 0, PAGE_SIZE);
+
+		flags = spin_lock_irqsave(&pool->lock);
+		LIST_INSERT_HEAD(&pool->pages, p, link);
+		pool->cnt++;
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	return added;
 }
 
+void page_stat(void)
+{
+	uint64_t free_pages = 0;
+
+	terminal_printf("order   free blocks   allocs     fails\n");
+	for (uint8_t i = 0; i <= PAGE_ORDER_MAX; i++) {
+		struct mmap_order_stat *stat = &mmap_state->stat[i];
+
+		terminal_printf("  %u       %lu        %lu        %lu\n",
+				i, stat->free, stat->alloc, stat->fail);
+		free_pages += stat->free << i;
+	}
+
+	// Pages of cpu caches aren't inside buddy lists, but they are free
+	terminal_printf("free pages: %lu of %lu (%lu of them in cpu caches)\n",
+			free_pages + mmap_state->cached, mmap_state->pages_cnt,
+			mmap_state->cached);
+
+	if (mmap_state->cache != NULL) {
+		struct page_cache *cache = mmap_state->cache();
+
+		terminal_printf("cpu page cache: hot: %u, cold: %u, hits: %lu, refills: %lu, drains: %lu\n",
+				cache->hot.cnt, cache->cold.cnt, cache->hits,
+				cache->refills, cache->drains);
+	}
+
+	terminal_printf("zeroed pool: %u pages, hits: %lu, misses: %lu\n",
+			mmap_state->zeroed.cnt, mmap_state->zeroed.hits,
+			mmap_state->zeroed.misses);
+}
+
+// Page may be shared by tasks on different cpus, so reference
+// counter is changed without any lock
 void page_incref(struct page *p)
 {
-	p->ref++;
+	__atomic_add_fetch(&p->ref, 1, __ATOMIC_RELAXED);
 }
 
 void page_decref(struct page *p)
 {
-	assert(p->ref > 0);
-	p->ref--;
+	uint32_t ref;
 
-	terminal_printf("decref page %p, refs: %d\n", p, p->ref);
+	assert(p->ref > 0);
+	ref = __atomic_sub_fetch(&p->ref, 1, __ATOMIC_ACQ_REL);
 
-	if (p->ref == 0)
+	if (ref == 0)
 		page_free(p);
 }
 
@@ -67,74 +360,146 @@ void *page2kva(struct page *p)
 	return VADDR(page2pa(p));
 }
 
-pte_t *mmap_lookup(pml4e_t *pml4, uint64_t va, bool create)
+// Page table shared after fork is referenced by read only entries with
+// copy-on-write bit. Table is copied only if it is still used by somebody
+// else, after that all its entries are shared by two tables, so they
+// become copy-on-write too. `leaf' means that table entries are pages
+// (large pages inside upper level tables are leaves too).
+static int mmap_table_unshare(uint64_t *entry, bool leaf)
 {
-	struct page *page4pdp = NULL, *page4pd = NULL, *page4pt = NULL;
-	pdpe_t pml4e = pml4[PML4_IDX(va)];
+	struct page *old = pa2page(PTE_ADDR(*entry)), *new;
+	uint64_t *src = page2kva(old), *dst;
 
-	if ((pml4e & PML4E_P) != 0)
-		goto pml4e_found;
-	if (create == false)
-		return NULL;
+	if (old->ref == 1)
+		goto done;
 
-	// Prepare new page directory pointer
-	if ((page4pdp = page_alloc()) == NULL)
-		return NULL;
-	memset(page2kva(page4pdp), 0, PAGE_SIZE);
-	page4pdp->ref = 1;
+	if ((new = page_alloc()) == NULL)
+		return -1;
+	new->ref = 1;
+	dst = page2kva(new);
 
-	// Insert new pdp into PML4
-	pml4e = pml4[PML4_IDX(va)] = page2pa(page4pdp) | PML4E_P | PML4E_W | PML4E_U;
+	for (uint16_t i = 0; i < NPT_ENTRIES; i++) {
+		if ((src[i] & PTE_P) != 0) {
+			bool page_entry = leaf == true || (src[i] & PDE_PS) != 0;
 
-pml4e_found:
-	assert((pml4e & PML4E_P) != 0);
+			// Read only pages are shared as is
+			if (page_entry == false || (src[i] & (PTE_W | PTE_COW)) != 0)
+				src[i] = (src[i] | PTE_COW) & ~PTE_W;
 
-	pdpe_t *pdp = VADDR(PML4E_ADDR(pml4e));
-	pdpe_t pdpe = pdp[PDP_IDX(va)];
+			page_incref(pa2page(PTE_ADDR(src[i])));
+		}
 
-	if ((pdpe & PDPE_P) != 0)
-		goto pdpe_found;
-	if (create == false)
-		return NULL;
+		dst[i] = src[i];
+	}
 
-	// Prepare new page directory
-	if ((page4pd = page_alloc()) == NULL)
-		return NULL;
-	memset(page2kva(page4pd), 0, PAGE_SIZE);
-	page4pd->ref = 1;
+	*entry = page2pa(new) | (*entry & PTE_FLAGS_MASK);
+	page_decref(old);
+
+done:
+	// Write, copy-on-write bits are the same on all levels
+	*entry = (*entry | PTE_W) & ~PTE_COW;
+
+	return 0;
+}
 
-	// Insert new page directory into page directory pointer table
-	pdpe = pdp[PDP_IDX(va)] = page2pa(page4pd) | PDPE_P | PDPE_W | PDPE_U;
+static uint16_t mmap_idx(uint64_t va, int level)
+{
+	switch (level) {
+	case MMAP_LEVEL_PML4:
+		return PML4_IDX(va);
+	case MMAP_LEVEL_PDP:
+		return PDP_IDX(va);
+	case MMAP_LEVEL_PD:
+		return PD_IDX(va);
+	default:
+		return PT_IDX(va);
+	}
+}
 
-pdpe_found:
-	assert((pdpe & PDPE_P) != 0);
+// Returns entry of `level' for `va'. Missing page tables are allocated
+// and shared ones are made private if `create' is set. Returns `NULL' if
+// `va' is mapped by a large page of upper level.
+static uint64_t *mmap_walk(pml4e_t *pml4, uint64_t va, bool create, int level)
+{
+	uint64_t *table = pml4;
+	bool unshared = false;
+	struct page *page;
+
+	for (int l = MMAP_LEVEL_PML4; l > level; l--) {
+		uint64_t *entry = &table[mmap_idx(va, l)];
+
+		if ((*entry & PTE_P) == 0) {
+			if (create == false)
+				return NULL;
+
+			// Prepare new page table of the next level
+			if ((page = page_alloc_zeroed()) == NULL)
+				return NULL;
+			page->ref = 1;
+
+			*entry = page2pa(page) | PTE_P | PTE_W | PTE_U;
+		} else if (l != MMAP_LEVEL_PML4 && (*entry & PDE_PS) != 0) {
+			return NULL;
+		} else if (create == true && (*entry & PTE_COW) != 0) {
+			if (mmap_table_unshare(entry, l == MMAP_LEVEL_PD) != 0)
+				return NULL;
+			unshared = true;
+		}
+
+		table = VADDR(PTE_ADDR(*entry));
+	}
 
-	pde_t *pd = VADDR(PDPE_ADDR(pdpe));
-	pde_t pde = pd[PD_IDX(va)];
+	// Drop cached translations (and paging-structure caches) which
+	// may still point into old shared tables
+	if (unshared == true)
+		invlpg((void *)(uintptr_t)va);
 
-	if ((pde & PDE_P) != 0)
-		goto pde_found;
-	if (create == false)
-		return NULL;
+	return &table[mmap_idx(va, level)];
+}
 
-	// Prepare new page table
-	if ((page4pt = page_alloc()) == NULL)
-		return NULL;
-	memset(page2kva(page4pt), 0, PAGE_SIZE);
-	page4pt->ref = 1;
+pte_t *mmap_lookup(pml4e_t *pml4, uint64_t va, bool create)
+{
+	return mmap_walk(pml4, va, create, MMAP_LEVEL_PT);
+}
 
-	// Insert new page table into page directory
-	pde = pd[PD_IDX(va)] = page2pa(page4pt) | PDE_P | PTE_W | PDE_U;
+pde_t *mmap_lookup_pde(pml4e_t *pml4, uint64_t va, bool create)
+{
+	return mmap_walk(pml4, va, create, MMAP_LEVEL_PD);
+}
+
+pdpe_t *mmap_lookup_pdpe(pml4e_t *pml4, uint64_t va, bool create)
+{
+	return mmap_walk(pml4, va, create, MMAP_LEVEL_PDP);
+}
 
-pde_found:
-	assert((pde & PDE_P) != 0);
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	if (tlb->cnt > TLB_GATHER_MAX) {
+		// Reload of cr3 drops all non-global entries (of the
+		// current PCID), kernel mappings are global
+		uintptr_t cr3;
+
+		asm volatile("mov %%cr3, %0\n\t"
+			     "mov %0, %%cr3" : "=r" (cr3) : : "memory");
+	} else {
+		for (uint32_t i = 0; i < tlb->cnt; i++)
+			invlpg((void *)tlb->va[i]);
+	}
 
-	pte_t *pt = VADDR(PDE_ADDR(pde));
+	tlb->cnt = 0;
+}
 
-	return &pt[PT_IDX(va)];
+// Invalidates `va' immediately, if there is no `tlb'
+static void mmap_invalidate(uintptr_t va, struct tlb_gather *tlb)
+{
+	if (tlb != NULL)
+		tlb_gather_add(tlb, va);
+	else
+		invlpg((void *)va);
 }
 
-int page_insert(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm)
+int page_insert_tlb(pml4e_t *pml4, struct page *p, uintptr_t va,
+		    unsigned perm, struct tlb_gather *tlb)
 {
 	pte_t *pte = mmap_lookup(pml4, va, 1);
 	if (pte == NULL)
@@ -143,14 +508,14 @@ int page_insert(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm)
 
 	// remap same page (possible change permissions)
 	if (PTE_ADDR(*pte) == page2pa(p)) {
-		invlpg((void *)va);
+		mmap_invalidate(va, tlb);
 
 		*pte = page2pa(p) | perm | PTE_P;
 		return 0;
 	}
 
 	// delete old mapping if exists
-	page_remove(pml4, va);
+	page_remove_tlb(pml4, va, tlb);
 
 	*pte = page2pa(p) | perm | PTE_P;
 	page_incref(p);
@@ -158,7 +523,12 @@ int page_insert(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm)
 	return 0;
 }
 
-void page_remove(pml4e_t *pml4, uintptr_t va)
+int page_insert(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm)
+{
+	return page_insert_tlb(pml4, p, va, perm, NULL);
+}
+
+void page_remove_tlb(pml4e_t *pml4, uintptr_t va, struct tlb_gather *tlb)
 {
 	struct page *p;
 	pte_t *pte;
@@ -168,9 +538,60 @@ void page_remove(pml4e_t *pml4, uintptr_t va)
 		// nothing to do
 		return;
 
+	// Page table may be shared with another task
+	if ((pte = mmap_lookup(pml4, va, true)) == NULL)
+		panic("page_remove: can't unshare page table");
+
 	page_decref(p);
 	*pte = 0;
 
+	mmap_invalidate(va, tlb);
+}
+
+void page_remove(pml4e_t *pml4, uintptr_t va)
+{
+	page_remove_tlb(pml4, va, NULL);
+}
+
+// Maps block of `LARGE_PAGE_ORDER' at 2Mb aligned `va'. Range must
+// not contain small pages.
+int page_insert_large(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm)
+{
+	pde_t *pde = mmap_lookup_pde(pml4, va, true);
+
+	assert(va % LARGE_PAGE_SIZE == 0 && p->order == LARGE_PAGE_ORDER);
+	if (pde == NULL)
+		// no memory
+		return -1;
+
+	if ((*pde & PDE_P) != 0 && (*pde & PDE_PS) == 0) {
+		terminal_printf("page_insert_large: range is used by small pages\n");
+		return -1;
+	}
+
+	page_remove_large(pml4, va);
+
+	*pde = page2pa(p) | perm | PDE_P | PDE_PS;
+	page_incref(p);
+
+	return 0;
+}
+
+void page_remove_large(pml4e_t *pml4, uintptr_t va)
+{
+	pde_t *pde = mmap_lookup_pde(pml4, va, false);
+
+	if (pde == NULL || (*pde & PDE_P) == 0 || (*pde & PDE_PS) == 0)
+		// nothing to do
+		return;
+
+	// Page table may be shared with another task
+	if ((pde = mmap_lookup_pde(pml4, va, true)) == NULL)
+		panic("page_remove_large: can't unshare page table");
+
+	page_decref(pa2page(LARGE_PAGE_ADDR(*pde)));
+	*pde = 0;
+
 	invlpg((void *)va);
 }
 
@@ -8,35 +8,139 @@
 #include <stdbool.h>
 
 #include "stdlib/queue.h"
+#include "kernel/lib/sync/spinlock.h"
 #include "kernel/lib/memory/mmu.h"
 
+// Buddy allocator manages blocks of `1 << order' pages
+#define PAGE_ORDER_MAX	10
+#define PAGE_ORDER_CNT	(PAGE_ORDER_MAX + 1)
+
+// Page is the first page of a free block (inside one of the free lists)
+#define PAGE_FLAG_FREE	(1 << 0)
+
 #define SIZEOF_PAGE64	24
 struct page {
-	uint32_t ref;
+	uint32_t ref;	// changed atomically (see `page_incref')
+
+	uint8_t order;	// order of the block (valid for the first page only)
+	uint8_t flags;
 
 	LIST_ENTRY(page) link;
 };
 LIST_HEAD(mmap_free_pages, page);
 
+struct mmap_order_stat {
+	uint64_t free;	// free blocks of this order
+	uint64_t alloc;	// successful allocations
+	uint64_t fail;	// failed allocations
+};
+
+// Per-cpu cache of order-0 pages. `hot' keeps recently freed pages
+// (their content is likely still inside cpu cache), `cold' is refilled
+// from the buddy allocator in batches.
+#define PAGE_CACHE_SIZE		32
+#define PAGE_CACHE_BATCH	16
+
+struct page_magazine {
+	uint32_t cnt;
+	struct page *pages[PAGE_CACHE_SIZE];
+};
+
+struct page_cache {
+	struct page_magazine hot;
+	struct page_magazine cold;
+
+	uint64_t hits;		// allocations served without buddy allocator
+	uint64_t refills;	// batches taken from buddy allocator
+	uint64_t drains;	// batches returned to buddy allocator
+};
+
+// Pool of already zeroed pages, refilled in background. Pool
+// pages have `ref == 0' and linked through `link'.
+#define PAGE_ZEROED_MAX		256
+
+struct page_zeroed_pool {
+	struct spinlock lock;
+	struct mmap_free_pages pages;
+	uint32_t cnt;
+
+	uint64_t hits;		// allocations served from the pool
+	uint64_t misses;	// allocations zeroed synchronously
+};
+
+// Deferred invalidations of the current address space. Entries are
+// flushed at once by `tlb_gather_flush', if there are more than
+// `TLB_GATHER_MAX' of them, the whole TLB is flushed instead. Gather
+// must be flushed before the address space is used by user code again.
+#define TLB_GATHER_MAX		32
+
+struct tlb_gather {
+	uint32_t cnt;
+	uintptr_t va[TLB_GATHER_MAX];
+};
+
+#define TLB_GATHER_INITIALIZER	{ .cnt = 0 }
+
+static inline void tlb_gather_add(struct tlb_gather *tlb, uintptr_t va)
+{
+	if (tlb->cnt < TLB_GATHER_MAX)
+		tlb->va[tlb->cnt] = va;
+	if (tlb->cnt <= TLB_GATHER_MAX)
+		tlb->cnt++;
+}
+
+void tlb_gather_flush(struct tlb_gather *tlb);
+
 struct mmap_state {
 	// Virtual address of physical pages array
 	struct page *pages;
 	uint64_t pages_cnt;
 
-	// List of the free pages
-	struct mmap_free_pages free;
+	// Lists of the free blocks, one list per order. Loader uses
+	// only `free[0]', kernel rebuilds all lists on startup.
+	struct spinlock lock;	// protects free lists and their statistic
+	struct mmap_free_pages free[PAGE_ORDER_CNT];
+	struct mmap_order_stat stat[PAGE_ORDER_CNT];
+
+	// Returns page cache of the current cpu (NULL inside loader)
+	struct page_cache *(*cache)(void);
+	uint64_t cached;	// free pages inside all cpu caches
+
+	struct page_zeroed_pool zeroed;
 };
 
 void mmap_init(struct mmap_state *state);
 
+// If `create' is set, missing page tables are allocated and page tables
+// shared copy-on-write are made private, so returned entry may be modified.
+// `NULL' is returned if `va' is mapped by large page of upper level.
 pte_t *mmap_lookup(pml4e_t *pml4, uint64_t va, bool create);
+pde_t *mmap_lookup_pde(pml4e_t *pml4, uint64_t va, bool create);
+pdpe_t *mmap_lookup_pdpe(pml4e_t *pml4, uint64_t va, bool create);
 int page_insert(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm);
 struct page *page_lookup(pml4e_t *pml4, uintptr_t va, pte_t **pte_p);
 void page_remove(pml4e_t *pml4, uintptr_t va);
 
+// Same as above, but invalidation of `va' is deferred into `tlb'
+int page_insert_tlb(pml4e_t *pml4, struct page *p, uintptr_t va,
+		    unsigned perm, struct tlb_gather *tlb);
+void page_remove_tlb(pml4e_t *pml4, uintptr_t va, struct tlb_gather *tlb);
+
+// 2Mb pages, `p' is the first page of `LARGE_PAGE_ORDER' block
+int page_insert_large(pml4e_t *pml4, struct page *p, uintptr_t va, unsigned perm);
+void page_remove_large(pml4e_t *pml4, uintptr_t va);
+
 struct page *page_alloc(void);
 void page_free(struct page *p);
 
+struct page *page_alloc_zeroed(void);
+uint32_t page_zeroed_refill(uint32_t cnt);
+
+struct page *page_alloc_order(uint8_t order);
+void page_free_order(struct page *p, uint8_t order);
+
+void page_stat(void);
+
 void page_incref(struct page *p);
 void page_decref(struct page *p);
 
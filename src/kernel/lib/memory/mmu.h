@@ -12,6 +12,18 @@
 #define PAGE_SIZE	4096
 #define PAGE_SHIFT	12
 
+// Mapped by page directory entry with `PDE_PS' (2Mb)
+#define LARGE_PAGE_SIZE		(1 << PD_SHIFT)
+#define LARGE_PAGE_ORDER	(PD_SHIFT - PAGE_SHIFT)
+// Mapped by page directory pointer entry with `PDPE_PS' (1Gb)
+#define HUGE_PAGE_SIZE		(1 << PDP_SHIFT)
+
+// Levels of page tables hierarchy
+#define MMAP_LEVEL_PT		1
+#define MMAP_LEVEL_PD		2
+#define MMAP_LEVEL_PDP		3
+#define MMAP_LEVEL_PML4		4
+
 #define NPML4_ENTRIES	512ull
 #define NPDP_ENTRIES	512ull
 #define NPD_ENTRIES	512ull
@@ -27,6 +39,7 @@
 # define PDPE_ADDR(paddr_)	((uint64_t)((paddr_) & ~0xfff))
 # define PDE_ADDR(paddr_)	((uint64_t)((paddr_) & ~0xfff))
 # define PTE_ADDR(paddr_)	((uint64_t)((paddr_) & ~0xfff))
+# define LARGE_PAGE_ADDR(paddr_)	((uint64_t)((paddr_) & ~(LARGE_PAGE_SIZE - 1ull)))
 
 # define IDX_MASK		((1 << 9) - 1) // 111111111b
 # define PML4_IDX(addr_)	(((uint64_t)addr_ >> PML4_SHIFT) & IDX_MASK)
@@ -62,6 +75,7 @@ typedef uint64_t pte_t;   // page table entry
 #define PML4E_PWT	(1 << 3)	// writethrough
 #define PML4E_PCD	(1 << 4)	// cache disable
 #define PML4E_A		(1 << 5)	// accessed
+#define PML4E_COW	(1 << 11)	// pdp is shared copy-on-write
 
 #define PDPE_P		(1 << 0)	// present
 #define PDPE_W		(1 << 1)	// write allowed
@@ -69,6 +83,8 @@ typedef uint64_t pte_t;   // page table entry
 #define PDPE_PWT	(1 << 3)	// writethrough
 #define PDPE_PCD	(1 << 4)	// cache disable
 #define PDPE_A		(1 << 5)	// accessed
+#define PDPE_PS		(1 << 7)	// 1Gb page
+#define PDPE_COW	(1 << 11)	// page directory is shared copy-on-write
 
 #define PDE_P		(1 << 0)	// present
 #define PDE_W		(1 << 1)	// write
@@ -76,6 +92,8 @@ typedef uint64_t pte_t;   // page table entry
 #define PDE_PWT		(1 << 3)	// writethrough
 #define PDE_PCD		(1 << 4)	// cache disable
 #define PDE_A		(1 << 5)	// accessed
+#define PDE_PS		(1 << 7)	// 2Mb page
+#define PDE_COW		(1 << 11)	// page table is shared copy-on-write
 
 #define PTE_P		(1 << 0)	// present
 #define PTE_W		(1 << 1)	// write
@@ -0,0 +1,266 @@
+#include "kernel/asm.h"
+
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/misc/util.h"
+
+#include "kernel/lib/memory/map.h"
+#include "kernel/lib/memory/slab.h"
+#include "kernel/lib/memory/layout.h"
+#include "kernel/lib/console/terminal.h"
+
+// Slab never exceeds this order, so large objects are not allowed
+#define KMEM_SLAB_ORDER_MAX	3
+// Try to put at least this count of objects into each slab
+#define KMEM_SLAB_OBJECTS_MIN	8
+
+#define KMEM_SLAB_SIZE(order_)	((uint32_t)PAGE_SIZE << (order_))
+
+// Descriptors of all caches are allocated from this one
+static struct kmem_cache kmem_cache_cache;
+static LIST_HEAD(kmem_cache_list, kmem_cache) caches = LIST_HEAD_INITIALIZER(kmem_cache_list);
+static struct spinlock caches_lock;
+
+static uint32_t kmem_slab_header(uint32_t objects, uint32_t align)
+{
+	return ROUND_UP((uint32_t)(sizeof(struct kmem_slab) + objects * sizeof(uint16_t)), align);
+}
+
+static uint32_t kmem_slab_objects(uint32_t size, uint32_t align, uint8_t order)
+{
+	uint32_t cnt = KMEM_SLAB_SIZE(order) / size;
+
+	// Slab header and free list share space with objects
+	while (cnt > 0 && kmem_slab_header(cnt, align) + cnt * size > KMEM_SLAB_SIZE(order))
+		cnt--;
+
+	return cnt;
+}
+
+static int kmem_cache_init(struct kmem_cache *cache, const char *name,
+			   size_t size, size_t align, kmem_ctor_t ctor)
+{
+	uintptr_t flags;
+	uint32_t unused;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if ((align & (align - 1)) != 0) {
+		terminal_printf("Can't create cache `%s': bad alignment\n", name);
+		return -1;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+	strncpy(cache->name, name, sizeof(cache->name) - 1);
+
+	cache->size = ROUND_UP((uint32_t)size, (uint32_t)align);
+	cache->align = align;
+	cache->ctor = ctor;
+
+	while (cache->order < KMEM_SLAB_ORDER_MAX &&
+	       kmem_slab_objects(cache->size, align, cache->order) < KMEM_SLAB_OBJECTS_MIN)
+		cache->order++;
+
+	cache->objects = kmem_slab_objects(cache->size, align, cache->order);
+	if (cache->objects == 0) {
+		terminal_printf("Can't create cache `%s': object is too large\n", name);
+		return -1;
+	}
+
+	// Unused space at the end of slab is used for coloring
+	unused = KMEM_SLAB_SIZE(cache->order) - cache->objects * cache->size -
+		kmem_slab_header(cache->objects, align);
+	cache->color_cnt = unused / ROUND_UP((uint32_t)KMEM_CACHE_LINE, cache->align) + 1;
+
+	LIST_INIT(&cache->full);
+	LIST_INIT(&cache->partial);
+	LIST_INIT(&cache->empty);
+	spinlock_init(&cache->lock, cache->name);
+
+	flags = spin_lock_irqsave(&caches_lock);
+	LIST_INSERT_HEAD(&caches, cache, link);
+	spin_unlock_irqrestore(&caches_lock, flags);
+
+	return 0;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, kmem_ctor_t ctor)
+{
+	struct kmem_cache *cache;
+
+	// Bootstrap cache of caches
+	if (kmem_cache_cache.objects == 0 &&
+	    kmem_cache_init(&kmem_cache_cache, "kmem_cache",
+			    sizeof(struct kmem_cache), 0, NULL) != 0)
+		panic("can't initialize cache of caches");
+
+	if ((cache = kmem_cache_alloc(&kmem_cache_cache)) == NULL) {
+		terminal_printf("Can't create cache `%s': no memory\n", name);
+		return NULL;
+	}
+
+	if (kmem_cache_init(cache, name, size, align, ctor) != 0) {
+		kmem_cache_free(&kmem_cache_cache, cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static void *kmem_slab_object(struct kmem_slab *slab, uint16_t idx)
+{
+	return (uint8_t *)slab + slab->offset + idx * slab->cache->size;
+}
+
+static struct kmem_slab *kmem_slab_create(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab;
+	struct page *page;
+	uint32_t color;
+
+	if ((page = page_alloc_order(cache->order)) == NULL)
+		return NULL;
+
+	color = cache->color_next;
+	cache->color_next = (cache->color_next + 1) % cache->color_cnt;
+
+	slab = page2kva(page);
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = 0;
+	slab->offset = kmem_slab_header(cache->objects, cache->align) +
+		color * ROUND_UP((uint32_t)KMEM_CACHE_LINE, cache->align);
+
+	for (uint16_t i = 0; i < cache->objects; i++) {
+		slab->next[i] = i + 1;
+
+		if (cache->ctor != NULL)
+			cache->ctor(kmem_slab_object(slab, i));
+	}
+
+	cache->slabs++;
+
+	return slab;
+}
+
+static void kmem_slab_destroy(struct kmem_slab *slab)
+{
+	assert(slab->inuse == 0);
+
+	slab->cache->slabs--;
+	page_free(pa2page(PADDR(slab)));
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab;
+	uintptr_t flags;
+
+	if (cache->inuse != 0)
+		panic("cache `%s' is destroyed, but objects are still in use",
+		      cache->name);
+
+	while ((slab = LIST_FIRST(&cache->empty)) != NULL) {
+		LIST_REMOVE(slab, link);
+		kmem_slab_destroy(slab);
+	}
+
+	flags = spin_lock_irqsave(&caches_lock);
+	LIST_REMOVE(cache, link);
+	spin_unlock_irqrestore(&caches_lock, flags);
+
+	spinlock_destroy(&cache->lock);
+	kmem_cache_free(&kmem_cache_cache, cache);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct kmem_slab *slab;
+	uintptr_t flags;
+	void *obj = NULL;
+
+	flags = spin_lock_irqsave(&cache->lock);
+
+	if ((slab = LIST_FIRST(&cache->partial)) != NULL) {
+		LIST_REMOVE(slab, link);
+	} else if ((slab = LIST_FIRST(&cache->empty)) != NULL) {
+		LIST_REMOVE(slab, link);
+	} else if ((slab = kmem_slab_create(cache)) == NULL) {
+		goto cleanup;
+	}
+
+	assert(slab->free < cache->objects);
+
+	obj = kmem_slab_object(slab, slab->free);
+	slab->free = slab->next[slab->free];
+	slab->inuse++;
+
+	if (slab->inuse == cache->objects)
+		LIST_INSERT_HEAD(&cache->full, slab, link);
+	else
+		LIST_INSERT_HEAD(&cache->partial, slab, link);
+
+	cache->allocs++;
+	cache->inuse++;
+
+cleanup:
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	// Slabs are naturally aligned, because buddy blocks are
+	struct kmem_slab *slab = (void *)ROUND_DOWN((uintptr_t)obj,
+						    (uintptr_t)KMEM_SLAB_SIZE(cache->order));
+	uint16_t idx = ((uintptr_t)obj - (uintptr_t)slab - slab->offset) / cache->size;
+	uintptr_t flags;
+
+	assert(slab->cache == cache);
+	assert(kmem_slab_object(slab, idx) == obj);
+	assert(slab->inuse > 0);
+
+	flags = spin_lock_irqsave(&cache->lock);
+
+	LIST_REMOVE(slab, link);
+
+	slab->next[idx] = slab->free;
+	slab->free = idx;
+	slab->inuse--;
+
+	if (slab->inuse != 0) {
+		LIST_INSERT_HEAD(&cache->partial, slab, link);
+	} else if (LIST_EMPTY(&cache->empty)) {
+		// Keep one empty slab to avoid allocation on the next request
+		LIST_INSERT_HEAD(&cache->empty, slab, link);
+	} else {
+		kmem_slab_destroy(slab);
+	}
+
+	cache->frees++;
+	cache->inuse--;
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_stat(void)
+{
+	struct kmem_cache *cache;
+	uintptr_t flags;
+
+	terminal_printf("name              size  order  per slab  slabs  inuse   allocs   frees\n");
+	flags = spin_lock_irqsave(&caches_lock);
+	LIST_FOREACH(cache, &caches, link) {
+		terminal_printf("%s", cache->name);
+		for (uint32_t i = strlen(cache->name); i < 18; i++)
+			terminal_printf(" ");
+
+		terminal_printf("%u  %u      %u      %lu   %lu   %lu   %lu\n",
+				cache->size, (uint32_t)cache->order, cache->objects,
+				cache->slabs, cache->inuse, cache->allocs, cache->frees);
+	}
+	spin_unlock_irqrestore(&caches_lock, flags);
+}
@@ -0,0 +1,73 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#ifdef __USER__
+# error "This file is for kernel internal use only"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stdlib/queue.h"
+#include "kernel/lib/sync/spinlock.h"
+
+// Slab is a block of `PAGE_SIZE << order' bytes. It starts with
+// `struct kmem_slab', followed by array of free objects indexes,
+// coloring gap and objects itself. Free objects are not touched by
+// allocator, so they stay in constructed state.
+struct kmem_slab {
+	LIST_ENTRY(kmem_slab) link;
+	struct kmem_cache *cache;
+
+	uint32_t offset;	// offset of the first object inside slab
+	uint16_t free;		// index of the first free object
+	uint16_t inuse;		// allocated objects count
+	uint16_t next[];	// `next[i]' - next free object after `i'
+};
+LIST_HEAD(kmem_slab_list, kmem_slab);
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_cache {
+	char name[32];
+
+	uint32_t size;		// object size (aligned)
+	uint32_t align;
+	uint32_t objects;	// objects per slab
+	uint8_t order;		// slab occupies `1 << order' pages
+
+	// Cache coloring: objects inside sequential slabs are shifted by
+	// `color * KMEM_CACHE_LINE' bytes, so they use different cache lines
+	uint32_t color_cnt;
+	uint32_t color_next;
+
+	// Called once for each object, when slab is created. Objects must
+	// be returned into the cache in constructed state.
+	kmem_ctor_t ctor;
+
+	struct spinlock lock;	// protects slab lists and statistic
+	struct kmem_slab_list full;
+	struct kmem_slab_list partial;
+	struct kmem_slab_list empty;
+
+	// statistic
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t slabs;
+	uint64_t inuse;
+
+	LIST_ENTRY(kmem_cache) link;
+};
+
+#define KMEM_CACHE_LINE		64
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void kmem_cache_stat(void);
+
+#endif
@@ -0,0 +1,126 @@
+#include "kernel/asm.h"
+
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/lib/sync/spinlock.h"
+#include "kernel/lib/console/terminal.h"
+
+#ifdef SPINLOCK_STAT
+// All named locks, used only to show statistic
+static struct spinlock spinlock_list_lock;
+static LIST_HEAD(spinlock_list, spinlock) spinlocks = LIST_HEAD_INITIALIZER(spinlock_list);
+#endif
+
+void spinlock_init(struct spinlock *lock, const char *name)
+{
+	lock->next = lock->owner = 0;
+	lock->name = name;
+
+#ifdef SPINLOCK_STAT
+	uintptr_t flags;
+
+	memset(&lock->stat, 0, sizeof(lock->stat));
+
+	flags = spin_lock_irqsave(&spinlock_list_lock);
+	LIST_INSERT_HEAD(&spinlocks, lock, link);
+	spin_unlock_irqrestore(&spinlock_list_lock, flags);
+#endif
+}
+
+// Must be called before freeing memory of initialized lock
+void spinlock_destroy(struct spinlock *lock)
+{
+	assert(spin_is_locked(lock) == false);
+
+#ifdef SPINLOCK_STAT
+	uintptr_t flags;
+
+	flags = spin_lock_irqsave(&spinlock_list_lock);
+	LIST_REMOVE(lock, link);
+	spin_unlock_irqrestore(&spinlock_list_lock, flags);
+#endif
+}
+
+void spin_lock(struct spinlock *lock)
+{
+	uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	uint64_t spins = 0;
+
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+		pause();
+		spins++;
+	}
+
+#ifdef SPINLOCK_STAT
+	lock->stat.acquires++;
+	lock->stat.spins += spins;
+	if (spins != 0)
+		lock->stat.contended++;
+	lock->stat.hold_start = rdtsc();
+#else
+	(void)spins;
+#endif
+}
+
+void spin_unlock(struct spinlock *lock)
+{
+	assert(spin_is_locked(lock));
+
+#ifdef SPINLOCK_STAT
+	uint64_t hold = rdtsc() - lock->stat.hold_start;
+
+	if (hold > lock->stat.hold_max)
+		lock->stat.hold_max = hold;
+#endif
+
+	// Only owner modifies `owner', so it is enough to store it
+	__atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+bool spin_is_locked(struct spinlock *lock)
+{
+	return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) !=
+		__atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+// Lock, which is taken by interrupt handlers, must be taken with
+// disabled interrupts, otherwise handler may spin forever
+uintptr_t spin_lock_irqsave(struct spinlock *lock)
+{
+	uintptr_t flags = irq_save();
+
+	spin_lock(lock);
+
+	return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, uintptr_t flags)
+{
+	spin_unlock(lock);
+	irq_restore(flags);
+}
+
+void spinlock_stat(void)
+{
+#ifdef SPINLOCK_STAT
+	struct spinlock *lock;
+	uintptr_t flags;
+
+	terminal_printf("name          acquires   contended   spins   max hold (cycles)\n");
+
+	flags = spin_lock_irqsave(&spinlock_list_lock);
+	LIST_FOREACH(lock, &spinlocks, link) {
+		terminal_printf("%s", lock->name);
+		for (uint32_t i = strlen(lock->name); i < 14; i++)
+			terminal_printf(" ");
+
+		terminal_printf("%lu   %lu   %lu   %lu\n",
+				lock->stat.acquires, lock->stat.contended,
+				lock->stat.spins, lock->stat.hold_max);
+	}
+	spin_unlock_irqrestore(&spinlock_list_lock, flags);
+#else
+	terminal_printf("lock statistic is disabled (see `--enable-lock-stat')\n");
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#ifdef __USER__
+# error "This file is for kernel internal use only"
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stdlib/queue.h"
+
+// Contention statistic (enabled by `--enable-lock-stat'), updated
+// only by the lock owner
+struct spinlock_stat {
+	uint64_t acquires;
+	uint64_t contended;	// acquisitions, which had to wait
+	uint64_t spins;		// total wait loop iterations
+	uint64_t hold_max;	// the longest hold time (in tsc cycles)
+	uint64_t hold_start;
+};
+
+// Ticket lock: cpus are served in order of arrival. Zeroed
+// lock is unlocked, `spinlock_init' is needed only to give
+// it a name (and to show its statistic).
+struct spinlock {
+	volatile uint16_t next;		// ticket for the next cpu
+	volatile uint16_t owner;	// ticket of the lock owner
+
+	const char *name;
+#ifdef SPINLOCK_STAT
+	struct spinlock_stat stat;
+	LIST_ENTRY(spinlock) link;
+#endif
+};
+
+void spinlock_init(struct spinlock *lock, const char *name);
+void spinlock_destroy(struct spinlock *lock);
+
+void spin_lock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+bool spin_is_locked(struct spinlock *lock);
+
+uintptr_t spin_lock_irqsave(struct spinlock *lock);
+void spin_unlock_irqrestore(struct spinlock *lock, uintptr_t flags);
+
+void spinlock_stat(void);
+
+#endif
@@ -15,6 +15,9 @@ struct kernel_config {
 	uint64_t pages_cnt;
 
 	union kernel_ptr gdt;
+
+	union kernel_ptr initrd;	// size is 0, if archive isn't loaded
+	uint64_t initrd_size;
 };
 
 #endif
@@ -1,13 +1,17 @@
+#include <cpuid.h>
+
 #include "stdlib/string.h"
 #include "stdlib/assert.h"
 
 #include "kernel/lib/disk/ata.h"
+#include "kernel/lib/compress/lz4.h"
 #include "kernel/lib/memory/map.h"
 #include "kernel/lib/memory/layout.h"
 #include "kernel/lib/console/terminal.h"
 
 #include "kernel/asm.h"
 #include "kernel/cpu.h"
+#include "kernel/initrd.h"
 #include "kernel/misc/gdt.h"
 #include "kernel/misc/elf.h"
 #include "kernel/misc/util.h"
@@ -37,6 +41,16 @@ static uint8_t *free_memory = end;
 static struct page *pages;
 static uint64_t pages_cnt;
 
+// Archive with user programs, located after the kernel
+static struct initrd_header *initrd;
+static uint32_t initrd_size;
+
+// Disk commands issued to read kernel and initrd
+static struct {
+	uint64_t commands;
+	uint64_t sectors;
+} loader_read_stat;
+
 pml4e_t *pml4;
 
 struct descriptor *gdt;
@@ -54,12 +68,14 @@ void *loader_alloc(uint64_t size, uint32_t align);
 void loader_detect_memory(struct bios_mmap_entry *mm, uint32_t cnt);
 int loader_init_memory(struct bios_mmap_entry *mm, uint32_t cnt);
 int loader_map_section(uint64_t va, uintptr_t pa, uint64_t len, bool hard);
+int loader_map_direct(uint64_t len);
 
 bool page_is_available(uint64_t paddr, struct bios_mmap_entry *mm, uint32_t cnt);
 
 struct descriptor *loader_init_gdt(void);
 
 int loader_read_kernel(uint64_t *kernel_entry_point);
+void loader_read_initrd(void);
 void loader_enter_long_mode(uint64_t kernel_entry_point);
 
 // Why this address? See `boot/boot.S'
@@ -70,15 +86,32 @@ void loader_main(void)
 	struct bios_mmap_entry *mm = (struct bios_mmap_entry *)BOOT_MMAP_ADDR;
 	uint32_t cnt = *((uint32_t *)BOOT_MMAP_ADDR - 1);
 
+	uint64_t start, read_end, initrd_end, memory_end;
+
+	string_init();
 	terminal_init();
 
+	start = rdtsc();
+
 	uint64_t kernel_entry_point;
 	if (loader_read_kernel(&kernel_entry_point) != 0)
 		goto something_bad;
+	read_end = rdtsc();
+
+	// Must be allocated before pages are marked as free
+	loader_read_initrd();
+	initrd_end = rdtsc();
 
 	loader_detect_memory(mm, cnt);
 	if (loader_init_memory(mm, cnt) != 0)
 		goto something_bad;
+	memory_end = rdtsc();
+
+	terminal_printf("Boot timing (Kcycles): kernel read %lu, initrd read %lu "
+			"(%lu commands, %lu sectors), memory init %lu\n",
+			(read_end - start) / 1000, (initrd_end - read_end) / 1000,
+			loader_read_stat.commands, loader_read_stat.sectors,
+			(memory_end - initrd_end) / 1000);
 
 	loader_enter_long_mode(kernel_entry_point);
 
@@ -97,29 +130,207 @@ void *loader_alloc(uint64_t size, uint32_t align)
 }
 
 #define KERNEL_BASE_DISK_SECTOR 2048 // 1Mb
+// Elf and program headers are read by the first command
+#define KERNEL_HEADER_SECTORS	8
+#define KERNEL_HEADER_SIZE	(KERNEL_HEADER_SECTORS * ATA_SECTOR_SIZE)
+// Alignment padding between segments is read too, if it is shorter
+#define KERNEL_RUN_GAP_MAX	8
+
+// Sectors are contiguous both on disk and in memory
+static int loader_read_run(uint32_t va, uint64_t lba, uint32_t sectors)
+{
+	while (sectors != 0) {
+		uint32_t cnt = MIN(sectors, (uint32_t)ATA_SECTORS_MAX);
+
+		if (disk_io_read_sectors((void *)va, lba, cnt) != 0) {
+			terminal_printf("Can't read sectors [%lu, %lu)\n", lba, lba + cnt);
+			return -1;
+		}
+		loader_read_stat.commands++;
+		loader_read_stat.sectors += cnt;
+
+		va += cnt * ATA_SECTOR_SIZE;
+		lba += cnt;
+		sectors -= cnt;
+	}
+
+	return 0;
+}
+
+// Program headers must be read together with elf header
+static int loader_check_elf(struct elf64_header *elf_header, uint32_t size)
+{
+	if (size < sizeof(*elf_header) || elf_header->e_magic != ELF_MAGIC) {
+		terminal_printf("Invalid elf format, magic mismatch (%u)", elf_header->e_magic);
+		return -1;
+	}
+	if ((uint8_t *)ELF64_PHEADER_LAST(elf_header) > (uint8_t *)elf_header + size) {
+		terminal_printf("Program headers don't fit into %u sectors\n", KERNEL_HEADER_SECTORS);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Sector tails may bring file data into bss
+static void loader_zero_bss(struct elf64_header *elf_header)
+{
+	for (struct elf64_program_header *ph = ELF64_PHEADER_FIRST(elf_header);
+	     ph < ELF64_PHEADER_LAST(elf_header); ph++) {
+		if (ph->p_type == ELF_PHEADER_TYPE_LOAD)
+			memset((void *)(uint32_t)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
+	}
+}
+
+// Reads compressed stream into `stage', until it has `size' bytes
+static int loader_lz4_fill(uint8_t *stage, uint32_t *have, uint32_t size)
+{
+	uint32_t sectors;
+
+	if (size <= *have)
+		return 0;
+
+	sectors = ROUND_UP(size - *have, ATA_SECTOR_SIZE) / ATA_SECTOR_SIZE;
+	if (loader_read_run((uint32_t)stage + *have,
+			    KERNEL_BASE_DISK_SECTOR + *have / ATA_SECTOR_SIZE, sectors) != 0)
+		return -1;
+	*have += sectors * ATA_SECTOR_SIZE;
+
+	return 0;
+}
+
+// Compressed kernel is the whole elf file in lz4 legacy frame. Loadable
+// segments keep the same offset between file and memory, so file image
+// is decompressed in place and segments get to their addresses without
+// copying. Each block is read into memory after the kernel and then
+// decompressed, elf header is decoded from the prefix of the first one.
+static int loader_read_kernel_lz4(uint8_t *head, uint64_t *kernel_entry_point)
+{
+	struct elf64_header *elf_header;
+	uint32_t delta = 0, image_size = 0, segments = 0;
+	uint32_t have = KERNEL_HEADER_SIZE, pos = sizeof(uint32_t), out = 0;
+	uint8_t *stage, *loader_end;
+	int32_t len;
+
+	elf_header = loader_alloc(KERNEL_HEADER_SIZE, PAGE_SIZE);
+	loader_end = free_memory;
+
+	len = lz4_decompress(head + 2 * sizeof(uint32_t),
+			     MIN(((uint32_t *)head)[1], KERNEL_HEADER_SIZE - 2 * sizeof(uint32_t)),
+			     elf_header, KERNEL_HEADER_SIZE);
+	if (len < 0 || loader_check_elf(elf_header, len) != 0) {
+		terminal_printf("Can't decompress elf header\n");
+		return -1;
+	}
+
+	for (struct elf64_program_header *ph = ELF64_PHEADER_FIRST(elf_header);
+	     ph < ELF64_PHEADER_LAST(elf_header); ph++) {
+		if (ph->p_type != ELF_PHEADER_TYPE_LOAD)
+			continue;
+
+		// See `loader_read_kernel'
+		ph->p_va &= 0xFFFFFFFFull;
+
+		if (segments++ == 0) {
+			delta = ph->p_va - ph->p_offset;
+		} else if (ph->p_va - ph->p_offset != delta) {
+			terminal_printf("Can't decompress kernel in place: segments are shifted\n");
+			return -1;
+		}
+		image_size = MAX(image_size, (uint32_t)(ph->p_offset + ph->p_filesz));
+
+		if (PADDR(free_memory) < PADDR(ph->p_va + ph->p_memsz))
+			free_memory = (uint8_t *)(uintptr_t)(ph->p_va + ph->p_memsz);
+	}
+	if (delta < (uint32_t)loader_end) {
+		terminal_printf("Can't decompress kernel in place: it overlaps loader\n");
+		return -1;
+	}
+
+	// Stage is reused by `loader_alloc()' later
+	stage = (uint8_t *)ROUND_UP((uint32_t)free_memory, PAGE_SIZE);
+	memcpy(stage, head, KERNEL_HEADER_SIZE);
+
+	// File tail (section headers, symbols) isn't needed
+	while (out < image_size) {
+		uint32_t size, expected = MIN(image_size - out, (uint32_t)LZ4_LEGACY_BLOCK_SIZE);
+
+		if (loader_lz4_fill(stage, &have, pos + sizeof(uint32_t)) != 0)
+			return -1;
+		size = *(uint32_t *)(stage + pos);
+		pos += sizeof(uint32_t);
+
+		if (size == 0 || size == LZ4_LEGACY_MAGIC)
+			panic("compressed kernel is truncated (%u of %u bytes)", out, image_size);
+		if (size > LZ4_COMPRESS_BOUND(LZ4_LEGACY_BLOCK_SIZE))
+			panic("compressed kernel block at %u is too large (%u bytes)", pos, size);
+
+		// Block must be read completely before it is decompressed
+		if (loader_lz4_fill(stage, &have, pos + size) != 0)
+			return -1;
+		assert(pos + size <= have);
+
+		// Short block would shift all following ones
+		len = lz4_decompress(stage + pos, size, (void *)(delta + out), expected);
+		if (len < 0 || (uint32_t)len != expected)
+			panic("corrupted compressed kernel block at %u", pos);
+
+		out += len;
+		pos += size;
+	}
+
+	loader_zero_bss(elf_header);
+	*kernel_entry_point = elf_header->e_entry;
+
+	return 0;
+}
+
+// Segments, which follow each other on disk and in memory (with the same
+// offset between them), are merged into a single run, which is read by
+// commands of `ATA_SECTORS_MAX' sectors. Compressed kernel is detected by
+// lz4 magic in the first sector.
 int loader_read_kernel(uint64_t *kernel_entry_point)
 {
-	struct elf64_header *elf_header = loader_alloc(sizeof(*elf_header), PAGE_SIZE);
+	struct elf64_header *elf_header;
+	uint32_t run_va = 0, run_sectors = 0;
+	uint64_t run_lba = 0;
 
-	if (disk_io_read_segment((uint32_t)elf_header, ATA_SECTOR_SIZE, KERNEL_BASE_DISK_SECTOR) != 0) {
+	elf_header = loader_alloc(KERNEL_HEADER_SIZE, PAGE_SIZE);
+	if (loader_read_run((uint32_t)elf_header, KERNEL_BASE_DISK_SECTOR, KERNEL_HEADER_SECTORS) != 0) {
 		terminal_printf("Can't read elf header\n");
 		return -1;
 	}
-	if (elf_header->e_magic != ELF_MAGIC) {
-		terminal_printf("Invalid elf format, magic mismatch (%u)", elf_header->e_magic);
+	if (elf_header->e_magic == LZ4_LEGACY_MAGIC)
+		return loader_read_kernel_lz4((uint8_t *)elf_header, kernel_entry_point);
+	if (loader_check_elf(elf_header, KERNEL_HEADER_SIZE) != 0)
 		return -1;
-	}
 
 	for (struct elf64_program_header *ph = ELF64_PHEADER_FIRST(elf_header);
 	     ph < ELF64_PHEADER_LAST(elf_header); ph++) {
+		if (ph->p_type != ELF_PHEADER_TYPE_LOAD)
+			continue;
+
 		// Manually truncate high address part. This is needed to make
 		// mapping [KERNBASE; KERNBASE+FREEMEM) -> [0; FREEMEM) valid
 		ph->p_va &= 0xFFFFFFFFull;
 
-		uint32_t lba = (ph->p_offset / ATA_SECTOR_SIZE) + KERNEL_BASE_DISK_SECTOR;
-		if (disk_io_read_segment(ph->p_va, ph->p_memsz, lba) != 0) {
-			terminal_printf("Can't read segment `%u'", lba);
-			return -1;
+		// Offset and address are congruent modulo sector size
+		uint32_t va = ROUND_DOWN((uint32_t)ph->p_va, ATA_SECTOR_SIZE);
+		uint64_t lba = (ph->p_offset / ATA_SECTOR_SIZE) + KERNEL_BASE_DISK_SECTOR;
+		uint32_t sectors = (ROUND_UP((uint32_t)(ph->p_va + ph->p_filesz), ATA_SECTOR_SIZE) - va) /
+				   ATA_SECTOR_SIZE;
+
+		if (run_sectors != 0 && lba >= run_lba &&
+		    lba <= run_lba + run_sectors + KERNEL_RUN_GAP_MAX &&
+		    va - run_va == (lba - run_lba) * ATA_SECTOR_SIZE) {
+			run_sectors = MAX(run_sectors, (uint32_t)(lba - run_lba) + sectors);
+		} else {
+			if (run_sectors != 0 && loader_read_run(run_va, run_lba, run_sectors) != 0)
+				return -1;
+
+			run_va = va;
+			run_lba = lba;
+			run_sectors = sectors;
 		}
 
 		if (PADDR(free_memory) < PADDR(ph->p_va + ph->p_memsz))
@@ -127,11 +338,39 @@ int loader_read_kernel(uint64_t *kernel_entry_point)
 			// return free memory areas after this function
 			free_memory = (uint8_t *)(uintptr_t)(ph->p_va + ph->p_memsz);
 	}
+	if (run_sectors != 0 && loader_read_run(run_va, run_lba, run_sectors) != 0)
+		return -1;
+
+	loader_zero_bss(elf_header);
 	*kernel_entry_point = elf_header->e_entry;
 
 	return 0;
 }
 
+// Archive is optional, without it kernel just has no user programs
+void loader_read_initrd(void)
+{
+	struct initrd_header *header = loader_alloc(ATA_SECTOR_SIZE, PAGE_SIZE);
+	uint32_t sectors;
+
+	if (loader_read_run((uint32_t)header, INITRD_DISK_SECTOR, 1) != 0 ||
+	    header->magic != INITRD_MAGIC || header->size < sizeof(*header)) {
+		terminal_printf("Initrd not found\n");
+		return;
+	}
+
+	// The rest of archive follows its first sector in memory
+	sectors = ROUND_UP(header->size, ATA_SECTOR_SIZE) / ATA_SECTOR_SIZE;
+	loader_alloc(sectors * ATA_SECTOR_SIZE - ATA_SECTOR_SIZE, 1);
+	if (loader_read_run((uint32_t)header + ATA_SECTOR_SIZE, INITRD_DISK_SECTOR + 1, sectors - 1) != 0) {
+		terminal_printf("Can't read initrd\n");
+		return;
+	}
+
+	initrd = header;
+	initrd_size = header->size;
+}
+
 #define MEMORY_TYPE_FREE 1
 void loader_detect_memory(struct bios_mmap_entry *mm, uint32_t cnt)
 {
@@ -172,9 +411,12 @@ int loader_init_memory(struct bios_mmap_entry *mm, uint32_t cnt)
 	config->pages.ptr = pages;
 	config->pml4.ptr = pml4;
 	config->gdt.ptr = gdt;
+	config->initrd.ptr = initrd;
+	config->initrd_size = initrd_size;
 
 	// Initialize `mmap_state'
-	state.free = (struct mmap_free_pages){ NULL };
+	for (uint8_t i = 0; i < PAGE_ORDER_CNT; i++)
+		LIST_INIT(&state.free[i]);
 	state.pages_cnt = pages_cnt;
 	state.pages = pages;
 	mmap_init(&state);
@@ -189,8 +431,9 @@ int loader_init_memory(struct bios_mmap_entry *mm, uint32_t cnt)
 		}
 
 		// Insert head is important, it guarantees that high physical
-		// addresses will be used before low ones.
-		LIST_INSERT_HEAD(&state.free, &pages[i], link);
+		// addresses will be used before low ones. Loader doesn't merge
+		// pages into buddy blocks, kernel will do it.
+		LIST_INSERT_HEAD(&state.free[0], &pages[i], link);
 	}
 
 	// Map kernel stack
@@ -218,7 +461,7 @@ int loader_init_memory(struct bios_mmap_entry *mm, uint32_t cnt)
 
 	// Make continuous mapping [KERNEL_BASE, KERNEL_BASE + FREE_MEM) -> [0, FREE_MEM)
 	// Without this mapping we can't compute virtual address from physical one
-	if (loader_map_section(KERNEL_BASE, 0x0, ROUND_DOWN(max_physical_address, PAGE_SIZE), false) != 0)
+	if (loader_map_direct(ROUND_DOWN(max_physical_address, PAGE_SIZE)) != 0)
 		return -1;
 
 	return 0;
@@ -273,6 +516,10 @@ bool page_is_available(uint64_t paddr, struct bios_mmap_entry *mm, uint32_t cnt)
 		// IO APIC registers mapped here
 		return false;
 
+	if (paddr >= SMP_TRAMPOLINE_PA && paddr < SMP_TRAMPOLINE_PA + SMP_TRAMPOLINE_SIZE)
+		// Kernel starts other processors here
+		return false;
+
 	if (paddr >= (uint64_t)(uintptr_t)end &&
 	    paddr  < (uint64_t)(uintptr_t)free_memory)
 		// This address range contains kernel
@@ -308,6 +555,9 @@ int loader_map_section(uint64_t va, uintptr_t pa, uint64_t len, bool hard)
 		assert((*pte & PTE_P) == 0);
 
 		*pte = PTE_ADDR(pa + i) | PTE_P | PTE_W;
+		if (va_aligned >= USER_TOP)
+			// Kernel mappings are the same in all address spaces
+			*pte |= PTE_G;
 
 		page = pa2page(PTE_ADDR(pa + i));
 		if (page->ref != 0)
@@ -327,6 +577,38 @@ int loader_map_section(uint64_t va, uintptr_t pa, uint64_t len, bool hard)
 	return 0;
 }
 
+// Direct mapping uses the largest pages: 1Gb (if cpu supports them),
+// then 2Mb, the rest is mapped by 4Kb pages. Free pages aren't marked
+// as used by direct mapping, kernel resets their counters anyway.
+int loader_map_direct(uint64_t len)
+{
+	uint32_t eax, ebx, ecx, edx;
+	bool huge = false;
+	uint64_t pa = 0;
+
+	// 1Gb pages - edx[26]
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) != 0)
+		huge = (edx & (1 << 26)) != 0;
+
+	for (; huge == true && pa + HUGE_PAGE_SIZE <= len; pa += HUGE_PAGE_SIZE) {
+		pdpe_t *pdpe = mmap_lookup_pdpe(pml4, KERNEL_BASE + pa, true);
+
+		if (pdpe == NULL)
+			return -1;
+		*pdpe = pa | PDPE_P | PDPE_W | PDPE_PS | PTE_G;
+	}
+
+	for (; pa + LARGE_PAGE_SIZE <= len; pa += LARGE_PAGE_SIZE) {
+		pde_t *pde = mmap_lookup_pde(pml4, KERNEL_BASE + pa, true);
+
+		if (pde == NULL)
+			return -1;
+		*pde = pa | PDE_P | PDE_W | PDE_PS | PTE_G;
+	}
+
+	return loader_map_section(KERNEL_BASE + pa, pa, len - pa, false);
+}
+
 void loader_enter_long_mode(uint64_t kernel_entry_point)
 {
 	// Reload gdt
@@ -15,4 +15,18 @@
 	ROUND_DOWN(addr_ + UNIQ_TOKEN(align) - 1, UNIQ_TOKEN(align));	\
 })
 
+#define MIN(a_, b_) ({						\
+	__typeof__(a_) UNIQ_TOKEN(a) = (a_);			\
+	__typeof__(b_) UNIQ_TOKEN(b) = (b_);			\
+	UNIQ_TOKEN(a) < UNIQ_TOKEN(b) ? UNIQ_TOKEN(a) : UNIQ_TOKEN(b);	\
+})
+
+#define MAX(a_, b_) ({						\
+	__typeof__(a_) UNIQ_TOKEN(a) = (a_);			\
+	__typeof__(b_) UNIQ_TOKEN(b) = (b_);			\
+	UNIQ_TOKEN(a) > UNIQ_TOKEN(b) ? UNIQ_TOKEN(a) : UNIQ_TOKEN(b);	\
+})
+
+#define ARRAY_SIZE(array_) (sizeof(array_) / sizeof((array_)[0]))
+
 #endif
@@ -4,9 +4,21 @@
 #include "stdlib/string.h"
 #include "stdlib/stdlib.h"
 
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/pci.h"
 #include "kernel/task.h"
+#include "kernel/thread.h"
+#include "kernel/initrd.h"
 #include "kernel/monitor.h"
-
+#include "kernel/disk/ide.h"
+#include "kernel/disk/bcache.h"
+#include "kernel/misc/util.h"
+#include "kernel/interrupt/interrupt.h"
+
+#include "kernel/lib/memory/map.h"
+#include "kernel/lib/memory/slab.h"
+#include "kernel/lib/sync/spinlock.h"
 #include "kernel/lib/console/terminal.h"
 
 #define COMMAND_LINE_PROMPT "-> "
@@ -93,6 +105,131 @@ static void clear_command_handler(int argc, char *argv[]);
 
 static void ps_command_handler(int argc, char *argv[]);
 static void kill_command_handler(int argc, char *argv[]);
+static void nice_command_handler(int argc, char *argv[]);
+static void cpu_command_handler(int argc, char *argv[]);
+static void run_command_handler(int argc, char *argv[]);
+static void ls_command_handler(int argc, char *argv[]);
+
+static void mem_command_handler(int argc, char *argv[]);
+static void slab_command_handler(int argc, char *argv[]);
+static void faults_command_handler(int argc, char *argv[]);
+
+static void locks_command_handler(int argc, char *argv[]);
+
+static void disk_command_handler(int argc, char *argv[]);
+static void bcache_command_handler(int argc, char *argv[]);
+static void dread_command_handler(int argc, char *argv[]);
+static void dwrite_command_handler(int argc, char *argv[]);
+// Monitor runs inside interrupt handler, but block cache may sleep, so
+// disk is accessed by kernel thread
+struct disk_command {
+	uint32_t lba;
+	uint32_t sectors;
+	int fill;		// byte to write, -1 if sectors are read
+};
+
+// Sequential reads are served by read ahead (see `bcache' stats)
+static uint64_t disk_thread_read(struct disk_command *cmd)
+{
+	uint32_t lba = cmd->lba, left = cmd->sectors;
+	struct page *page;
+	uint64_t sum = 0;
+	uint8_t *data;
+
+	if ((page = page_alloc()) == NULL) {
+		terminal_printf("Can't read disk: no memory for buffer\n");
+		return 0;
+	}
+	data = page2kva(page);
+
+	while (left != 0) {
+		uint32_t cnt = MIN(left, (uint32_t)(PAGE_SIZE / ATA_SECTOR_SIZE));
+
+		if (bcache_read_segment(data, cnt * ATA_SECTOR_SIZE, lba) != 0)
+			break;
+		for (uint32_t i = 0; i < cnt * ATA_SECTOR_SIZE; i++)
+			sum += data[i];
+
+		lba += cnt;
+		left -= cnt;
+	}
+
+	page_free(page);
+
+	return sum;
+}
+
+static void disk_thread_fill(struct disk_command *cmd)
+{
+	uint32_t end = cmd->lba + cmd->sectors;
+
+	for (uint32_t block = ROUND_DOWN(cmd->lba, BCACHE_BLOCK_SECTORS); block < end;
+	     block += BCACHE_BLOCK_SECTORS) {
+		uint32_t from = MAX(block, cmd->lba) - block;
+		uint32_t to = MIN(block + BCACHE_BLOCK_SECTORS, end) - block;
+		struct buf *buf;
+
+		if ((buf = bcache_read(block)) == NULL)
+			return;
+
+		memset((uint8_t *)buf->data + from * ATA_SECTOR_SIZE, cmd->fill,
+		       (to - from) * ATA_SECTOR_SIZE);
+		bcache_write(buf);
+		bcache_release(buf);
+	}
+}
+
+static void disk_thread(void *arg)
+{
+	struct disk_command *cmd = arg;
+	uint64_t start = rdtsc(), sum = 0;
+
+	if (cmd->fill < 0)
+		sum = disk_thread_read(cmd);
+	else
+		disk_thread_fill(cmd);
+
+	terminal_printf("%s %u sectors from %u: sum %lu, %lu Kcycles\n",
+			cmd->fill < 0 ? "read" : "filled", cmd->sectors, cmd->lba,
+			sum, (rdtsc() - start) / 1000);
+	if (cmd->fill < 0)
+		bcache_stat();
+}
+
+// Thread exits when `disk_thread' returns, its stack (together with
+// the command) is released by breakpoint handler (see `thread_foo')
+static void disk_command_start(uint32_t lba, uint32_t sectors, int fill)
+{
+	struct disk_command cmd = { .lba = lba, .sectors = sectors, .fill = fill };
+	struct task *thread;
+
+	if (sectors == 0 || lba + sectors < lba)
+		return terminal_printf("Can't access disk: invalid sectors range\n");
+
+	if ((thread = thread_create(fill < 0 ? "dread" : "dwrite", disk_thread,
+				    (const uint8_t *)&cmd, sizeof(cmd))) == NULL)
+		return;
+	thread_run(thread);
+}
+
+static void dread_command_handler(int argc, char *argv[])
+{
+	if (argc != 3)
+		return terminal_printf("Usage: dread <lba> <sectors>\n");
+
+	disk_command_start(atoi(argv[1]), atoi(argv[2]), -1);
+}
+
+// Dirty blocks are written back by flusher thread
+static void dwrite_command_handler(int argc, char *argv[])
+{
+	if (argc != 4)
+		return terminal_printf("Usage: dwrite <lba> <sectors> <byte>\n");
+
+	disk_command_start(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]) & 0xFF);
+}
+
+static void pci_command_handler(int argc, char *argv[]);
 
 typedef void (*command_handler_t)(int argc, char *argv[]);
 static const struct monitor_command {
@@ -107,6 +244,25 @@ static const struct monitor_command {
 	// process related
 	{ .name = "ps",		.description = "show running processes",	.handler = ps_command_handler },
 	{ .name = "kill",	.description = "kill process by id",		.handler = kill_command_handler },
+	{ .name = "nice",	.description = "set process priority",		.handler = nice_command_handler },
+	{ .name = "cpu",	.description = "show processors load",		.handler = cpu_command_handler },
+	{ .name = "run",	.description = "start program by name",		.handler = run_command_handler },
+	{ .name = "ls",		.description = "list programs in initrd",	.handler = ls_command_handler },
+
+	// memory related
+	{ .name = "mem",	.description = "show physical memory stats",	.handler = mem_command_handler },
+	{ .name = "slab",	.description = "show kernel object caches",	.handler = slab_command_handler },
+	{ .name = "faults",	.description = "show copy-on-write faults",	.handler = faults_command_handler },
+
+	// synchronization related
+	{ .name = "locks",	.description = "show spinlocks contention",	.handler = locks_command_handler },
+
+	// device related
+	{ .name = "disk",	.description = "show disk requests stats",	.handler = disk_command_handler },
+	{ .name = "bcache",	.description = "show block cache stats",	.handler = bcache_command_handler },
+	{ .name = "dread",	.description = "read sectors through cache",	.handler = dread_command_handler },
+	{ .name = "dwrite",	.description = "fill sectors through cache",	.handler = dwrite_command_handler },
+	{ .name = "pci",	.description = "show pci devices",		.handler = pci_command_handler },
 
 	{ .name = "",		.description = "end of commands list",		.handler = NULL },
 };
@@ -180,3 +336,97 @@ static void kill_command_handler(int argc, char *argv[])
 
 	task_kill(atoi(argv[1]));
 }
+
+static void nice_command_handler(int argc, char *argv[])
+{
+	if (argc != 3)
+		return terminal_printf("Usage: nice <task_id> <priority>\n");
+
+	task_nice(atoi(argv[1]), atoi(argv[2]));
+}
+
+static void cpu_command_handler(int argc, char *argv[])
+{
+	uint64_t now = rdtsc();
+
+	(void)argc; (void)argv;
+
+	terminal_printf("cpu  ready  idle\n");
+	for (cpuid_t id = 0; id < cpu_count(); id++) {
+		struct cpu_context *cpu = cpu_context_by_id(id);
+		uint64_t total = now - cpu->start_time;
+
+		if (cpu->online == false)
+			continue;
+
+		terminal_printf("%u    %u      %u%%\n", (uint32_t)id, cpu->runq.cnt,
+				(uint32_t)(total != 0 ? cpu->idle_time * 100 / total : 0));
+	}
+}
+
+static void run_command_handler(int argc, char *argv[])
+{
+	int id;
+
+	if (argc != 2)
+		return terminal_printf("Usage: run <program>\n");
+
+	if ((id = task_spawn(argv[1])) >= 0)
+		terminal_printf("task [%d] has been started\n", id);
+}
+
+static void ls_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	initrd_list();
+}
+
+static void mem_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	page_stat();
+}
+
+static void slab_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	kmem_cache_stat();
+}
+
+static void faults_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	page_fault_stat();
+}
+
+static void locks_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	spinlock_stat();
+}
+
+static void disk_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	ide_stat();
+}
+
+static void bcache_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	bcache_stat();
+}
+
+static void pci_command_handler(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+
+	pci_list();
+}
@@ -0,0 +1,101 @@
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/asm.h"
+#include "kernel/pci.h"
+
+// Devices found on boot, configuration space isn't changed later
+static struct pci_device pci_devices[PCI_DEVICES_MAX];
+static uint32_t pci_devices_cnt;
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset)
+{
+	outl(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (bus << 16) | (dev << 11) |
+	     (func << 8) | (offset & ~0x3));
+
+	return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read(struct pci_device *dev, uint8_t offset)
+{
+	return pci_config_read(dev->bus, dev->dev, dev->func, offset);
+}
+
+// Status register, which follows command one, is write-1-to-clear, so
+// half of the dword is written
+void pci_write16(struct pci_device *dev, uint8_t offset, uint16_t value)
+{
+	outl(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (dev->bus << 16) | (dev->dev << 11) |
+	     (dev->func << 8) | (offset & ~0x3));
+	outw(PCI_CONFIG_DATA + (offset & 0x2), value);
+}
+
+static void pci_probe(uint8_t bus, uint8_t dev, uint8_t func)
+{
+	uint32_t id = pci_config_read(bus, dev, func, PCI_VENDOR_ID);
+	uint32_t class = pci_config_read(bus, dev, func, PCI_CLASS);
+	struct pci_device *pci;
+
+	if (pci_devices_cnt == PCI_DEVICES_MAX) {
+		terminal_printf("Can't register pci device %u:%u.%u: too many devices\n",
+				bus, dev, func);
+		return;
+	}
+
+	pci = &pci_devices[pci_devices_cnt++];
+	pci->bus = bus;
+	pci->dev = dev;
+	pci->func = func;
+	pci->vendor_id = id & 0xFFFF;
+	pci->device_id = id >> 16;
+	pci->class = class >> 24;
+	pci->subclass = (class >> 16) & 0xFF;
+	pci->prog_if = (class >> 8) & 0xFF;
+}
+
+// Brute force scan of all buses, it takes a few milliseconds
+void pci_init(void)
+{
+	for (uint32_t bus = 0; bus < 256; bus++) {
+		for (uint8_t dev = 0; dev < 32; dev++) {
+			uint8_t header, funcs;
+
+			if ((pci_config_read(bus, dev, 0, PCI_VENDOR_ID) & 0xFFFF) == PCI_VENDOR_NONE)
+				continue;
+
+			header = pci_config_read(bus, dev, 0, PCI_HEADER_TYPE) >> 16;
+			funcs = (header & PCI_HEADER_MULTI_FUNC) != 0 ? 8 : 1;
+
+			for (uint8_t func = 0; func < funcs; func++) {
+				if ((pci_config_read(bus, dev, func, PCI_VENDOR_ID) & 0xFFFF) == PCI_VENDOR_NONE)
+					continue;
+
+				pci_probe(bus, dev, func);
+			}
+		}
+	}
+
+	terminal_printf("[PCI] devices: %u\n", pci_devices_cnt);
+}
+
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass)
+{
+	for (uint32_t i = 0; i < pci_devices_cnt; i++) {
+		if (pci_devices[i].class == class && pci_devices[i].subclass == subclass)
+			return &pci_devices[i];
+	}
+
+	return NULL;
+}
+
+void pci_list(void)
+{
+	terminal_printf("bus:dev.func  vendor  device  class\n");
+	for (uint32_t i = 0; i < pci_devices_cnt; i++) {
+		struct pci_device *pci = &pci_devices[i];
+
+		terminal_printf("%u:%u.%u         %x    %x    %x.%x.%x\n",
+				pci->bus, pci->dev, pci->func,
+				pci->vendor_id, pci->device_id,
+				pci->class, pci->subclass, pci->prog_if);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS	0xCF8
+#define PCI_CONFIG_DATA		0xCFC
+#define PCI_CONFIG_ENABLE	(1u << 31)
+
+// Configuration space header (type 0)
+#define PCI_VENDOR_ID		0x00
+#define PCI_COMMAND		0x04
+#define PCI_CLASS		0x08	// revision, prog if, subclass, class
+#define PCI_HEADER_TYPE		0x0C	// bits 16:23 of the dword
+#define PCI_BAR(n_)		(0x10 + (n_) * 4)
+
+#define PCI_VENDOR_NONE		0xFFFF
+#define PCI_HEADER_MULTI_FUNC	(1 << 7)
+
+#define PCI_COMMAND_IO		(1 << 0)
+#define PCI_COMMAND_MEMORY	(1 << 1)
+#define PCI_COMMAND_MASTER	(1 << 2)
+
+#define PCI_BAR_IO		(1 << 0)
+#define PCI_BAR_IO_MASK		(~0x3u)
+
+#define PCI_CLASS_STORAGE	0x01
+#define PCI_SUBCLASS_IDE	0x01
+// IDE controller supports bus mastering
+#define PCI_PROG_IF_IDE_BM	(1 << 7)
+
+#define PCI_DEVICES_MAX		32
+
+struct pci_device {
+	uint8_t bus;
+	uint8_t dev;
+	uint8_t func;
+
+	uint16_t vendor_id;
+	uint16_t device_id;
+
+	uint8_t class;
+	uint8_t subclass;
+	uint8_t prog_if;
+};
+
+void pci_init(void);
+void pci_list(void);
+
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass);
+
+uint32_t pci_read(struct pci_device *dev, uint8_t offset);
+void pci_write16(struct pci_device *dev, uint8_t offset, uint16_t value);
+
+#endif
@@ -0,0 +1,151 @@
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/lib/memory/mmu.h"
+#include "kernel/lib/memory/layout.h"
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/smp.h"
+#include "kernel/tlb.h"
+#include "kernel/task.h"
+#include "kernel/misc/gdt.h"
+#include "kernel/loader/config.h"
+#include "kernel/interrupt/apic.h"
+#include "kernel/interrupt/timer.h"
+#include "kernel/interrupt/interrupt.h"
+
+// See `smp_entry.S'
+extern uint8_t smp_trampoline[], smp_trampoline_end[];
+extern uint32_t smp_trampoline_lock, smp_trampoline_arrived;
+extern uint64_t smp_trampoline_entry;
+
+// Trampoline is linked into kernel, but processors use its copy
+#define SMP_TRAMPOLINE_VAR(sym_) ((volatile __typeof__(sym_) *)VADDR(SMP_TRAMPOLINE_PA + \
+	((uint8_t *)&(sym_) - smp_trampoline)))
+
+// Time to wait for processors after startup IPI (in microseconds)
+#define SMP_ARRIVE_DELAY	10000
+// Time to wait for processors initialization (in microseconds)
+#define SMP_ONLINE_TIMEOUT	1000000
+
+static struct gdtr {
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed)) smp_gdtr;
+
+// Application processors, which are ready to schedule tasks
+static volatile uint32_t smp_online;
+
+// Each io port write takes about 1us
+static void smp_delay(uint32_t us)
+{
+	for (uint32_t i = 0; i < us; i++)
+		outb(0x80, 0);
+}
+
+static void smp_send_ipi(uint32_t icr)
+{
+	APIC_WRITE(APIC_OFFSET_ICR_HIGH, 0);
+	APIC_WRITE(APIC_OFFSET_ICR_LOW, icr);
+
+	while ((APIC_READ(APIC_OFFSET_ICR_LOW) & APIC_ICR_PENDING) != 0)
+		pause();
+}
+
+static void smp_ap_start(void)
+{
+	struct cpu_context *cpu = cpu_context();
+
+	// Trampoline stack isn't used anymore, next processor may start
+	__atomic_store_n(SMP_TRAMPOLINE_VAR(smp_trampoline_lock), 0, __ATOMIC_RELEASE);
+
+	cpu->online = true;
+	__atomic_add_fetch(&smp_online, 1, __ATOMIC_RELEASE);
+
+	terminal_printf("cpu %u is online\n", (uint32_t)cpu_get_id());
+
+	schedule();
+}
+
+// Entry point of application processors (called by trampoline)
+static void smp_ap_main(void)
+{
+	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
+	struct cpu_context *cpu;
+
+	// Switch to kernel page tables and gdt (cs selector is the same)
+	lcr3(PADDR(config->pml4.ptr));
+	asm volatile("lgdt %0" : : "m" (smp_gdtr));
+	asm volatile(
+		"movw %w0, %%ds\n\t"
+		"movw %w0, %%es\n\t"
+		"movw %w0, %%ss" : : "r" (GD_KD)
+	);
+
+	cpu_register();
+	cpu = cpu_context();
+	cpu->pml4 = config->pml4.ptr;
+	tlb_init_cpu();
+
+	kernel_lock();
+
+	task_init_cpu();
+	interrupt_init_cpu();
+	if (timer_init() != 0)
+		panic("timer_init failed");
+
+	// Switch to cpu own stack, it will be reused by interrupts
+	asm volatile(
+		"movq %0, %%rsp\n\t"
+		"call *%1" : : "r" (EXCEPTION_STACK_TOP(cpu_get_id())), "r" (smp_ap_start)
+	);
+}
+
+// Starts all application processors and waits until they are ready
+// to schedule tasks. Kernel lock must not be held.
+void smp_init(void)
+{
+	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
+	pml4e_t *kernel_pml4 = config->pml4.ptr;
+	pml4e_t *pml4 = VADDR(SMP_TRAMPOLINE_PML4);
+	pdpe_t *pdp = VADDR(SMP_TRAMPOLINE_PDP);
+	pde_t *pd = VADDR(SMP_TRAMPOLINE_PD);
+	volatile uint32_t *arrived = SMP_TRAMPOLINE_VAR(smp_trampoline_arrived);
+
+	// Bootstrap processor schedules tasks too
+	cpu_context()->online = true;
+
+	memcpy(VADDR(SMP_TRAMPOLINE_PA), smp_trampoline, smp_trampoline_end - smp_trampoline);
+	*SMP_TRAMPOLINE_VAR(smp_trampoline_entry) = (uintptr_t)smp_ap_main;
+	sgdt(smp_gdtr);
+
+	// Trampoline is identity mapped (by one 2Mb page) to enable paging,
+	// kernel space is the same as for tasks
+	memset(pml4, 0, PAGE_SIZE);
+	memset(pdp, 0, PAGE_SIZE);
+	memset(pd, 0, PAGE_SIZE);
+
+	memcpy(&pml4[PML4_IDX(USER_TOP)], &kernel_pml4[PML4_IDX(USER_TOP)],
+	       PAGE_SIZE - PML4_IDX(USER_TOP)*sizeof(pml4e_t));
+	pml4[0] = SMP_TRAMPOLINE_PDP | PML4E_P | PML4E_W;
+	pdp[0] = SMP_TRAMPOLINE_PD | PDPE_P | PDPE_W;
+	pd[0] = 0x0 | PDE_P | PDE_W | PDE_PS;
+
+	// INIT-SIPI-SIPI sequence (broadcast)
+	smp_send_ipi(APIC_ICR_ALL_BUT_SELF | APIC_ICR_ASSERT | APIC_ICR_INIT);
+	smp_delay(10000);
+	for (uint32_t i = 0; i < 2; i++) {
+		smp_send_ipi(APIC_ICR_ALL_BUT_SELF | APIC_ICR_ASSERT | APIC_ICR_STARTUP |
+			     (SMP_TRAMPOLINE_PA >> PAGE_SHIFT));
+		smp_delay(200);
+	}
+
+	smp_delay(SMP_ARRIVE_DELAY);
+	for (uint32_t i = 0; i < SMP_ONLINE_TIMEOUT && smp_online < *arrived; i++)
+		smp_delay(1);
+
+	if (smp_online < *arrived)
+		panic("only %u of %u processors started", smp_online, *arrived);
+}
@@ -0,0 +1,18 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+// Selector of 32-bit code segment inside trampoline gdt (other
+// selectors are the same as in kernel gdt)
+#define SMP_GD_CODE32		0x18
+
+// Trampoline page tables and stack (see `SMP_TRAMPOLINE_PA')
+#define SMP_TRAMPOLINE_PML4	(SMP_TRAMPOLINE_PA + PAGE_SIZE * 1)
+#define SMP_TRAMPOLINE_PDP	(SMP_TRAMPOLINE_PA + PAGE_SIZE * 2)
+#define SMP_TRAMPOLINE_PD	(SMP_TRAMPOLINE_PA + PAGE_SIZE * 3)
+#define SMP_TRAMPOLINE_STACK	(SMP_TRAMPOLINE_PA + PAGE_SIZE * 6)
+
+#ifndef __ASSEMBLER__
+void smp_init(void);
+#endif
+
+#endif
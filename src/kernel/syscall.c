@@ -1,5 +1,10 @@
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/vma.h"
 #include "kernel/task.h"
 #include "kernel/syscall.h"
+#include "kernel/interrupt/timer.h"
+#include "kernel/misc/gdt.h"
 #include "kernel/lib/memory/map.h"
 #include "kernel/lib/memory/mmu.h"
 #include "kernel/lib/memory/layout.h"
@@ -10,30 +15,6 @@
 
 #include "kernel/lib/console/terminal.h"
 
-static int task_share_page(struct task *dest, struct task *src, void *va, unsigned perm)
-{
-	uintptr_t va_addr = (uintptr_t)va;
-	struct page *p;
-
-	p = page_lookup(src->pml4, va_addr, NULL);
-	assert(p != NULL);
-
-	if ((perm & PTE_W) != 0 || (perm & PTE_COW) != 0) {
-		perm = (perm | PTE_COW) & ~PTE_W;
-		if (page_insert(src->pml4, p, va_addr, perm) != 0)
-			return -1;
-		if (page_insert(dest->pml4, p, va_addr, perm) != 0)
-			return -1;
-	} else {
-		if (page_insert(dest->pml4, p, va_addr, perm) != 0)
-			return -1;
-	}
-
-	terminal_printf("share page %p (va: %p): refs: %d\n", p, va, p->ref);
-
-	return 0;
-}
-
 static int sys_fork(struct task *task)
 {
 	struct task *child = task_new("child");
@@ -43,58 +24,99 @@ static int sys_fork(struct task *task)
 	child->context = task->context;
 	child->context.gprs.rax = 0; // return value
 
-	for (uint16_t i = 0; i <= PML4_IDX(USER_TOP); i++) {
-		uintptr_t pdpe_pa = PML4E_ADDR(task->pml4[i]);
+	if (vma_copy(child, task) != 0) {
+		task_destroy(child);
+		return -1;
+	}
 
+	// Share whole user page tables copy-on-write. Page tables (and
+	// then pages) are copied only when write fault lands in their range.
+	for (uint16_t i = 0; i <= PML4_IDX(USER_TOP); i++) {
 		if ((task->pml4[i] & PML4E_P) == 0)
 			continue;
 
-		pdpe_t *pdpe = VADDR(pdpe_pa);
-		for (uint16_t j = 0; j < NPDP_ENTRIES; j++) {
-			uintptr_t pde_pa = PDPE_ADDR(pdpe[j]);
+		task->pml4[i] = (task->pml4[i] | PML4E_COW) & ~PML4E_W;
+		child->pml4[i] = task->pml4[i];
+		page_incref(pa2page(PML4E_ADDR(task->pml4[i])));
+	}
+
+	// Parent may have cached writable translations
+	lcr3(rcr3());
 
-			if ((pdpe[j] & PDPE_P) == 0)
-				continue;
+	task_make_ready(child);
 
-			pde_t *pde = VADDR(pde_pa);
-			for (uint16_t k = 0; k < NPD_ENTRIES; k++) {
-				uintptr_t pte_pa = PTE_ADDR(pde[k]);
+	return child->id;
+}
 
-				if ((pde[k] & PDE_P) == 0)
-					continue;
+// Kernel reads user strings only by `vma_copy_string', page fault
+// handler doesn't expect supervisor access to user space
+static int sys_puts(struct task *task, uintptr_t user_str)
+{
+	char buf[128];
+	int len;
 
-				pte_t *pte = VADDR(pte_pa);
-				for (uint16_t l = 0; l < NPT_ENTRIES; l++) {
-					if ((pte[l] & PTE_P) == 0)
-						continue;
+	terminal_printf("task [%d]: ", task->id);
+	do {
+		if ((len = vma_copy_string(task, buf, user_str, sizeof(buf))) < 0)
+			return -1;
+		terminal_printf("%s", buf);
+		user_str += len;
+	} while (len == sizeof(buf) - 1);
 
-					unsigned perm = pte[l] & PTE_FLAGS_MASK;
-					if (task_share_page(child, task, PAGE_ADDR(i, j, k, l, 0), perm) != 0) {
-						task_destroy(child);
-						return -1;
-					}
-				}
-			}
-		}
-	}
+	return 0;
+}
+
+static int sys_spawn(struct task *task, uintptr_t user_name)
+{
+	char name[sizeof(task->name)];
 
-	child->state = TASK_STATE_READY;
+	if (vma_copy_string(task, name, user_name, sizeof(name)) < 0)
+		return -1;
 
-	return child->id;
+	return task_spawn(name);
 }
 
-void syscall(struct task *task)
+// Program name is copied, because `task_exec' releases caller memory
+static int sys_exec(struct task *task, uintptr_t user_name)
+{
+	char name[sizeof(task->name)];
+
+	if (vma_copy_string(task, name, user_name, sizeof(name)) < 0)
+		return -1;
+
+	return task_exec(task, name);
+}
+
+static uintptr_t sys_mmap(struct task *task, uintptr_t addr, size_t size, unsigned flags)
+{
+	unsigned vma_flags = 0;
+
+	if ((flags & ~(MMAP_WRITE | MMAP_LARGE)) != 0)
+		return 0;
+
+	if ((flags & MMAP_WRITE) != 0)
+		vma_flags |= VMA_WRITE;
+	if ((flags & MMAP_LARGE) != 0)
+		vma_flags |= VMA_LARGE;
+
+	return vma_mmap(task, addr, size, vma_flags);
+}
+
+// Arguments are passed in rdi, rsi, rdx, r10, r8 (rcx and r11 are
+// clobbered by `syscall' instruction), result is returned in rax.
+// Returns only if task may continue execution.
+static void syscall_handle(struct task *task)
 {
 	enum syscall syscall = task->context.gprs.rax;
 	int64_t ret = 0;
 
 	switch (syscall) {
 	case SYSCALL_PUTS:
-		terminal_printf("task [%d]: %s", task->id, (char *)task->context.gprs.rbx);
+		ret = sys_puts(task, task->context.gprs.rdi);
 		break;
 	case SYSCALL_EXIT:
 		terminal_printf("task [%d] exited with value `%d'\n",
-				task->id, task->context.gprs.rbx);
+				task->id, task->context.gprs.rdi);
 		task_destroy(task);
 
 		return schedule();
@@ -103,10 +125,90 @@ void syscall(struct task *task)
 		break;
 	case SYSCALL_YIELD:
 		return schedule();
+	case SYSCALL_SLEEP:
+		task->context.gprs.rax = 0;
+		task_sleep(task, task->context.gprs.rdi);
+
+		return schedule();
+	case SYSCALL_CLOCK_GETTIME:
+		ret = timer_clock();
+		break;
+	case SYSCALL_SPAWN:
+		ret = sys_spawn(task, task->context.gprs.rdi);
+		break;
+	case SYSCALL_VFORK:
+		// Parent sleeps until child calls exec or exits
+		if (task_vfork(task) == NULL) {
+			ret = -1;
+			break;
+		}
+
+		return schedule();
+	case SYSCALL_EXEC:
+		ret = sys_exec(task, task->context.gprs.rdi);
+		break;
+	case SYSCALL_MMAP:
+		ret = sys_mmap(task, task->context.gprs.rdi, task->context.gprs.rsi,
+			       task->context.gprs.rdx);
+		break;
+	case SYSCALL_MUNMAP:
+		ret = vma_munmap(task, task->context.gprs.rdi, task->context.gprs.rsi);
+		break;
 	default:
 		panic("unknown syscall `%u'\n", syscall);
 	}
 
 	task->context.gprs.rax = ret;
+}
+
+// `int $INTERRUPT_VECTOR_SYSCALL' handler
+void syscall(struct task *task)
+{
+	syscall_handle(task);
 	task_run(task);
 }
+
+// Called by `syscall_entry', returned context is restored by `sysret'
+struct task_context *syscall_fast_handler(struct task_context *ctx)
+{
+	struct task *task;
+
+	kernel_lock();
+
+	task = cpu_context()->task;
+	task->context = *ctx;
+	task->state = TASK_STATE_READY;
+
+	if (task->killed) {
+		task_destroy(task);
+		schedule();
+	}
+
+	syscall_handle(task);
+
+	// Always enable interrupts (like `task_run' does)
+	task->context.rflags |= RFLAGS_IF;
+	task->state = TASK_STATE_RUN;
+
+	// Syscall may make other tasks ready (see `task_run')
+	timer_update();
+	kernel_unlock();
+
+	return &task->context;
+}
+
+void syscall_init(void)
+{
+	extern void syscall_entry();
+	struct cpu_context *cpu = cpu_context();
+
+	// Same stack as for interrupts from user mode (see `tss.rsp0')
+	cpu->kernel_rsp = EXCEPTION_STACK_TOP(cpu_get_id());
+	wrmsr(MSR_KERNEL_GS_BASE, (uintptr_t)cpu);
+
+	// sysret loads cs = STAR[63:48] + 16, ss = STAR[63:48] + 8
+	wrmsr(MSR_STAR, ((uint64_t)GD_KD << 48) | ((uint64_t)GD_KT << 32));
+	wrmsr(MSR_LSTAR, (uintptr_t)syscall_entry);
+	wrmsr(MSR_SFMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF | RFLAGS_AC);
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
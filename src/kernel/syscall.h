@@ -2,5 +2,6 @@
 #define __KERNEL_SYSCALL_H__
 
 void syscall(struct task *task);
+void syscall_init(void);
 
 #endif
@@ -1,289 +1,701 @@
+#include <cpuid.h>
+
 #include "stdlib/assert.h"
 #include "stdlib/string.h"
 
 #include "kernel/lib/memory/map.h"
+#include "kernel/lib/memory/slab.h"
 #include "kernel/lib/memory/layout.h"
 #include "kernel/lib/console/terminal.h"
 
 #include "kernel/asm.h"
 #include "kernel/cpu.h"
+#include "kernel/tlb.h"
+#include "kernel/vma.h"
 #include "kernel/task.h"
+#include "kernel/initrd.h"
+#include "kernel/thread.h"
 #include "kernel/misc/elf.h"
 #include "kernel/misc/gdt.h"
 #include "kernel/misc/util.h"
 #include "kernel/loader/config.h"
+#include "kernel/interrupt/timer.h"
 
 
-static LIST_HEAD(task_free, task) free_tasks = LIST_HEAD_INITIALIZER(task_free);
-static struct task tasks[TASK_MAX_CNT];
+static TAILQ_HEAD(task_list, task) tasks = TAILQ_HEAD_INITIALIZER(tasks);
+static struct kmem_cache *task_cache;
 static task_id_t last_task_id;
 
+// Idle task waits by `mwait' instead of `hlt', if cpu supports it
+static bool task_idle_mwait;
+
+// Task id hash, used to find task without scanning all tasks
+#define TASK_HASH_SIZE		64
+static LIST_HEAD(task_hash, task) task_hash[TASK_HASH_SIZE];
+
+static struct task_runq *task_runq(struct task *task)
+{
+	return &cpu_context_by_id(task->cpu)->runq;
+}
+
+// Run queue functions are called with disabled interrupts
+static void runq_insert(struct task *task)
+{
+	struct task_runq *runq = task_runq(task);
+
+	assert(task->runq_link.tqe_prev == NULL);
+
+	spin_lock(&runq->lock);
+	TAILQ_INSERT_TAIL(&runq->queue[task->priority], task, runq_link);
+	runq->mask |= (1u << task->priority);
+	runq->cnt++;
+	spin_unlock(&runq->lock);
+}
+
+// Must be called under `runq->lock'
+static void runq_unlink(struct task_runq *runq, struct task *task)
+{
+	TAILQ_REMOVE(&runq->queue[task->priority], task, runq_link);
+	task->runq_link.tqe_prev = NULL;
+	runq->cnt--;
+
+	if (TAILQ_EMPTY(&runq->queue[task->priority]))
+		runq->mask &= ~(1u << task->priority);
+}
+
+static void runq_remove(struct task *task)
+{
+	struct task_runq *runq = task_runq(task);
+
+	assert(task->runq_link.tqe_prev != NULL);
+
+	spin_lock(&runq->lock);
+	runq_unlink(runq, task);
+	spin_unlock(&runq->lock);
+}
+
+// Returns the first task with the highest priority
+static struct task *runq_pick(struct task_runq *runq)
+{
+	struct task *task = NULL;
+
+	spin_lock(&runq->lock);
+	if (runq->mask != 0) {
+		task = TAILQ_FIRST(&runq->queue[__builtin_ctz(runq->mask)]);
+		runq_unlink(runq, task);
+	}
+	spin_unlock(&runq->lock);
+
+	return task;
+}
+
+// Tasks don't migrate, so new task is placed on the least loaded cpu
+static cpuid_t task_select_cpu(void)
+{
+	uint32_t min_load = UINT32_MAX;
+	cpuid_t selected = cpu_get_id();
+
+	for (cpuid_t id = 0; id < cpu_count(); id++) {
+		struct cpu_context *cpu = cpu_context_by_id(id);
+		uint32_t load = cpu->runq.cnt + (cpu->task != &cpu->self_task);
+
+		if (cpu->online == false || load >= min_load)
+			continue;
+
+		min_load = load;
+		selected = id;
+	}
+
+	return selected;
+}
+
+static struct task *task_lookup(task_id_t task_id)
+{
+	struct task *task;
+
+	LIST_FOREACH(task, &task_hash[task_id % TASK_HASH_SIZE], hash_link) {
+		if (task->id == task_id)
+			return task;
+	}
+
+	return NULL;
+}
+
+// Task becomes ready and will be selected by `schedule'
+void task_make_ready(struct task *task)
+{
+	if (task->cpu == CPU_ID_NONE)
+		task->cpu = task_select_cpu();
+
+	task->state = TASK_STATE_READY;
+	if (task->runq_link.tqe_prev == NULL)
+		runq_insert(task);
+
+	// Other cpu may run without timer, so it doesn't know about new task
+	if (task->cpu != cpu_get_id()) {
+		struct cpu_context *cpu = cpu_context_by_id(task->cpu);
+
+		if (cpu->online && cpu->slice_end == 0)
+			cpu_reschedule(task->cpu);
+	}
+}
+
+static void task_wakeup(void *arg)
+{
+	struct task *task = arg;
+
+	assert(task->state == TASK_STATE_SLEEP);
+	task_make_ready(task);
+}
+
+// Task leaves run queue for `ms' milliseconds, caller must call
+// `schedule' after this
+void task_sleep(struct task *task, uint64_t ms)
+{
+	assert(task->cpu == cpu_get_id());
+
+	task->state = TASK_STATE_SLEEP;
+	timer_add(&task->timer, ms, task_wakeup, task);
+}
+
 void task_init(void)
 {
-	struct cpu_context *cpu = cpu_context();
+	task_cache = kmem_cache_create("task", sizeof(struct task), KMEM_CACHE_LINE, NULL);
+	if (task_cache == NULL)
+		panic("can't create task cache");
+
+	for (uint32_t i = 0; i < TASK_HASH_SIZE; i++)
+		LIST_INIT(&task_hash[i]);
+
+	vma_init();
 
-	for (int32_t i = TASK_MAX_CNT-1; i >= 0; i--) {
-		LIST_INSERT_HEAD(&free_tasks, &tasks[i], free_link);
-		tasks[i].state = TASK_STATE_FREE;
+	// MONITOR/MWAIT - ecx[3]
+	uint32_t eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0)
+		task_idle_mwait = (ecx & (1 << 3)) != 0;
+
+	task_init_cpu();
+}
+
+static void task_idle(void *arg __attribute__((unused)))
+{
+	struct task_runq *runq = &cpu_context()->runq;
+	uint32_t zeroed;
+
+	while (1) {
+		// Spend idle time on filling zeroed pages pool. Pool has its
+		// own lock, page is cleared with interrupts enabled and run
+		// queue is checked after each page.
+		zeroed = page_zeroed_refill(1);
+
+		// Interrupt, which makes some task ready, must not be lost
+		// between check and halt. `sti' takes effect only after the
+		// next instruction, so pending interrupt wakes up `hlt'.
+		asm volatile("cli");
+		if (task_idle_mwait)
+			asm volatile("monitor" : : "a" (&runq->mask), "c" (0), "d" (0));
+
+		if (__atomic_load_n(&runq->mask, __ATOMIC_RELAXED) != 0) {
+			// call schedule
+			asm volatile("int3");
+			continue;
+		}
+
+		if (zeroed != 0)
+			asm volatile("sti");
+		else if (task_idle_mwait)
+			// Also wakes up, when other cpu inserts task into run queue
+			asm volatile("sti; mwait" : : "a" (0), "c" (0));
+		else
+			asm volatile("sti; hlt");
 	}
+}
+
+// Must be called by each cpu
+void task_init_cpu(void)
+{
+	struct cpu_context *cpu = cpu_context();
+
+	spinlock_init(&cpu->runq.lock, "runq");
+	for (uint32_t i = 0; i < TASK_PRIORITY_CNT; i++)
+		TAILQ_INIT(&cpu->runq.queue[i]);
 
 	cpu->task = &cpu->self_task;
 	memset(cpu->task, 0, sizeof(*cpu->task));
+
+	if ((cpu->idle = thread_create("idle", task_idle, NULL, 0)) == NULL)
+		panic("can't create idle task");
+	cpu->idle->cpu = cpu_get_id();
+
+	cpu->start_time = rdtsc();
 }
 
 void task_list(void)
 {
-	terminal_printf("task_id        name           owner\n");
-	for (uint32_t i = 0; i < TASK_MAX_CNT; i++) {
-		if (tasks[i].state != TASK_STATE_RUN &&
-		    tasks[i].state != TASK_STATE_READY)
+	struct task *task;
+
+	terminal_printf("task_id        name           owner     priority\n");
+	TAILQ_FOREACH(task, &tasks, link) {
+		if (task->state != TASK_STATE_RUN &&
+		    task->state != TASK_STATE_READY &&
+		    task->state != TASK_STATE_SLEEP)
 			continue;
 
-		terminal_printf("  %d         %s          %s\n", tasks[i].id, tasks[i].name,
-				(tasks[i].context.cs & GDT_DPL_U) == 0 ? "kernel" : "user");
+		terminal_printf("  %d         %s          %s      %u\n", task->id, task->name,
+				(task->context.cs & GDT_DPL_U) == 0 ? "kernel" : "user",
+				(uint32_t)task->priority);
 	}
 }
 
-void task_kill(task_id_t task_id)
+// Returns child, which runs inside address space of `task'
+static struct task *task_vfork_child(struct task *task)
 {
-	for (uint32_t i = 0; i < TASK_MAX_CNT; i++) {
-		if (tasks[i].state != TASK_STATE_RUN &&
-		    tasks[i].state != TASK_STATE_READY)
-			continue;
+	struct task *child;
 
-		if (tasks[i].id != task_id)
-			continue;
+	TAILQ_FOREACH(child, &tasks, link) {
+		if (child->vfork_parent == task)
+			return child;
+	}
 
-		if ((tasks[i].context.cs & GDT_DPL_U) == 0)
-			return terminal_printf("error: killing kernel tasks is forbidden\n");
+	return NULL;
+}
 
-		return task_destroy(&tasks[i]);
+void task_kill(task_id_t task_id)
+{
+	struct task *task = task_lookup(task_id);
+
+	if (task == NULL || (task->state != TASK_STATE_RUN &&
+			     task->state != TASK_STATE_READY &&
+			     task->state != TASK_STATE_SLEEP))
+		return terminal_printf("Can't kill task `%d': no such task\n", task_id);
+
+	// Parent is woken up by the child, its page tables must stay alive
+	// until then. Kill the child instead, parent may be killed later.
+	if (task_vfork_child(task) != NULL)
+		return terminal_printf("Can't kill task `%d': vfork child runs in its address space\n",
+				       task_id);
+
+	if ((task->context.cs & GDT_DPL_U) == 0)
+		return terminal_printf("error: killing kernel tasks is forbidden\n");
+
+	if (task->state == TASK_STATE_RUN) {
+		// Task is running on other cpu (task of the current cpu
+		// is `READY' inside kernel), it will be destroyed there
+		task->killed = true;
+		return;
 	}
 
-	terminal_printf("Can't kill task `%d': no such task\n", task_id);
+	task_destroy(task);
 }
 
-struct task *task_new(const char *name)
+void task_nice(task_id_t task_id, uint32_t priority)
+{
+	struct task *task = task_lookup(task_id);
+	bool queued;
+
+	if (task == NULL)
+		return terminal_printf("Can't change priority of task `%d': no such task\n", task_id);
+	if (priority >= TASK_PRIORITY_CNT)
+		return terminal_printf("Can't change priority of task `%d': priority must be less than %u\n",
+				       task_id, TASK_PRIORITY_CNT);
+
+	// Queue depends on priority, so ready task must be moved
+	if ((queued = (task->runq_link.tqe_prev != NULL)))
+		runq_remove(task);
+	task->priority = priority;
+	if (queued)
+		runq_insert(task);
+}
+
+// Allocates pml4 with kernel space mapped, user space is empty
+static pml4e_t *task_pml4_new(void)
 {
 	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
 	pml4e_t *kernel_pml4 = config->pml4.ptr;
 	struct page *pml4_page;
+	pml4e_t *pml4;
+
+	if ((pml4_page = page_alloc_zeroed()) == NULL)
+		return NULL;
+	page_incref(pml4_page);
+
+	pml4 = page2kva(pml4_page);
+
+	// Kernel space is equal for each task
+	memcpy(&pml4[PML4_IDX(USER_TOP)], &kernel_pml4[PML4_IDX(USER_TOP)],
+	       PAGE_SIZE - PML4_IDX(USER_TOP)*sizeof(pml4e_t));
+
+	return pml4;
+}
+
+// Creates task which uses `pml4' (with already taken reference)
+static struct task *task_alloc(const char *name, pml4e_t *pml4)
+{
 	struct task *task;
 
-	task = LIST_FIRST(&free_tasks);
-	if (task == NULL) {
-		terminal_printf("Can't create task `%s': no more free tasks\n", name);
+	if ((task = kmem_cache_alloc(task_cache)) == NULL) {
+		terminal_printf("Can't create task `%s': no memory for new task\n", name);
 		return NULL;
 	}
-
-	LIST_REMOVE(task, free_link);
 	memset(task, 0, sizeof(*task));
 
 	strncpy(task->name, name, sizeof(task->name));
 
 	task->id = ++last_task_id;
 	task->state = TASK_STATE_DONT_RUN;
+	task->priority = TASK_PRIORITY_DEFAULT;
+	task->cpu = CPU_ID_NONE;
+	task->pml4 = pml4;
+	TAILQ_INIT(&task->vmas);
+
+	TAILQ_INSERT_TAIL(&tasks, task, link);
+	LIST_INSERT_HEAD(&task_hash[task->id % TASK_HASH_SIZE], task, hash_link);
+
+	return task;
+}
+
+struct task *task_new(const char *name)
+{
+	struct task *task;
+	pml4e_t *pml4;
 
-	if ((pml4_page = page_alloc()) == NULL) {
+	if ((pml4 = task_pml4_new()) == NULL) {
 		terminal_printf("Can't create task `%s': no memory for new pml4\n", name);
 		return NULL;
 	}
-	page_incref(pml4_page);
 
-	task->pml4 = page2kva(pml4_page);
-
-	// clear PML4
-	memset(task->pml4, 0, PAGE_SIZE);
-
-	// Kernel space is equal for each task
-	memcpy(&task->pml4[PML4_IDX(USER_TOP)], &kernel_pml4[PML4_IDX(USER_TOP)],
-	       PAGE_SIZE - PML4_IDX(USER_TOP)*sizeof(pml4e_t));
+	if ((task = task_alloc(name, pml4)) == NULL) {
+		page_decref(pa2page(PADDR(pml4)));
+		return NULL;
+	}
+	task->asid = tlb_asid_new();
 
 	return task;
 }
 
-void task_destroy(struct task *task)
+// Child runs inside address space of the parent (no page tables are
+// copied) until it calls `task_exec' or exits. Parent doesn't run
+// meanwhile, it is woken up by `task_vfork_done'.
+struct task *task_vfork(struct task *parent)
 {
-	if (task->pml4 == NULL)
-		// Nothing to do (possible when `task_new' failed)
-		return;
+	struct task *child;
 
-	struct cpu_context *cpu = cpu_context();
-	assert(task != &cpu->self_task);
-	if (task == cpu->task)
-		cpu->task = NULL;
-
-	// We must be inside `task' address space. Because we use
-	// virtual address to modify page table. This is needed to
-	// avoid any problems when killing forked process.
-	uint64_t old_cr3 = rcr3();
-	if (old_cr3 != PADDR(task->pml4)) {
-		lcr3(PADDR(task->pml4));
+	page_incref(pa2page(PADDR(parent->pml4)));
+	if ((child = task_alloc(parent->name, parent->pml4)) == NULL) {
+		page_decref(pa2page(PADDR(parent->pml4)));
+		return NULL;
 	}
 
-	// remove all mapped pages from current task
-	for (uint16_t i = 0; i <= PML4_IDX(USER_TOP); i++) {
-		uintptr_t pdpe_pa = PML4E_ADDR(task->pml4[i]);
+	child->context = parent->context;
+	child->context.gprs.rax = 0; // return value
+	child->vfork_parent = parent;
+	child->asid = parent->asid;
 
-		if ((task->pml4[i] & PML4E_P) == 0)
-			continue;
+	parent->context.gprs.rax = child->id;
+	parent->state = TASK_STATE_DONT_RUN;
 
-		pdpe_t *pdpe = VADDR(pdpe_pa);
-		for (uint16_t j = 0; j < NPDP_ENTRIES; j++) {
-			uintptr_t pde_pa = PDPE_ADDR(pdpe[j]);
+	task_make_ready(child);
 
-			if ((pdpe[j] & PDPE_P) == 0)
-				continue;
+	return child;
+}
 
-			pde_t *pde = VADDR(pde_pa);
-			for (uint16_t k = 0; k < NPD_ENTRIES; k++) {
-				uintptr_t pte_pa = PTE_ADDR(pde[k]);
+// Gives borrowed address space back to the parent
+static void task_vfork_done(struct task *task)
+{
+	struct task *parent = task->vfork_parent;
 
-				if ((pde[k] & PDE_P) == 0)
-					continue;
+	task->vfork_parent = NULL;
+	page_decref(pa2page(PADDR(task->pml4)));
+	task->pml4 = NULL;
 
-				pte_t *pte = VADDR(pte_pa);
-				for (uint16_t l = 0; l < NPT_ENTRIES; l++) {
-					if ((pte[l] & PTE_P) == 0)
-						continue;
+	// Child may run on other cpu, so TLB of the parent cpu may keep
+	// stale entries of the old address space id
+	parent->asid = tlb_asid_new();
+	task_make_ready(parent);
+}
 
-					page_decref(pa2page(PTE_ADDR(pte[l])));
-				}
+// Drops reference to page table (or page if `level' is 0 or entry maps
+// large page). Page tables may be shared copy-on-write after fork, so
+// subtree is released only by its last user.
+static void task_table_decref(uint64_t entry, int level)
+{
+	bool large = level > 0 && (entry & PDE_PS) != 0;
+	struct page *p = pa2page(large ? LARGE_PAGE_ADDR(entry) : PTE_ADDR(entry));
+	uint64_t *table = page2kva(p);
+
+	if (level > 0 && large == false && p->ref == 1) {
+		for (uint16_t i = 0; i < NPT_ENTRIES; i++) {
+			if ((table[i] & PTE_P) != 0)
+				task_table_decref(table[i], level - 1);
+		}
+	}
 
-				pde[k] = 0;
-				page_decref(pa2page(pte_pa));
-			}
+	page_decref(p);
+}
 
-			pdpe[j] = 0;
-			page_decref(pa2page(pde_pa));
-		}
+// Releases user space of the task together with its pml4
+static void task_unmap(struct task *task)
+{
+	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
 
-		task->pml4[i] = 0;
-		page_decref(pa2page(pdpe_pa));
-	}
+	// Don't destroy kernel pml4
+	assert(config->pml4.ptr != task->pml4);
 
-	// Reload cr3, because it may be reused after `page_decref'
-	if (old_cr3 != PADDR(task->pml4)) {
-		lcr3(old_cr3);
-	} else {
-		struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
+	// Page tables are released through direct mapping, but cr3 must
+	// not point to pml4, which may be reused after `page_decref'
+	if ((rcr3() & ~CR3_PCID_MASK) == PADDR(task->pml4))
 		lcr3(PADDR(config->pml4.ptr));
 
-		// Don't destroy kernel pml4
-		assert(config->pml4.ptr != task->pml4);
+	// remove all mapped pages from current task
+	for (uint16_t i = 0; i <= PML4_IDX(USER_TOP); i++) {
+		if ((task->pml4[i] & PML4E_P) == 0)
+			continue;
+
+		task_table_decref(task->pml4[i], 3);
+		task->pml4[i] = 0;
 	}
 
 	page_decref(pa2page(PADDR(task->pml4)));
 	task->pml4 = NULL;
+}
+
+void task_destroy(struct task *task)
+{
+	if (task->pml4 == NULL)
+		// Nothing to do (possible when `task_new' failed)
+		return;
 
-	LIST_INSERT_HEAD(&free_tasks, task, free_link);
-	task->state = TASK_STATE_FREE;
+	struct cpu_context *cpu = cpu_context();
+	assert(task != &cpu->self_task);
+	assert(task_vfork_child(task) == NULL);
+	if (task == cpu->task)
+		// Interrupt handler saves context into current task, so it
+		// must point to something
+		cpu->task = &cpu->self_task;
+
+	if (task->vfork_parent != NULL)
+		task_vfork_done(task);
+	else
+		task_unmap(task);
+	vma_destroy(task);
+
+	if (task->runq_link.tqe_prev != NULL)
+		runq_remove(task);
+	timer_del(&task->timer);
+	LIST_REMOVE(task, hash_link);
+	TAILQ_REMOVE(&tasks, task, link);
 
 	terminal_printf("task [%d] has been destroyed\n", task->id);
+
+	// Slab page may be released, callers must not touch the task after
+	kmem_cache_free(task_cache, task);
 }
 
-static int task_load_segment(struct task *task, const char *name,
-			     uint8_t *binary, struct elf64_program_header *ph)
+// Only pages with file content are allocated, the rest of the segment
+// (bss) is populated on demand. Pages are filled through direct mapping,
+// so the task address space needn't be loaded. If binary is page aligned
+// (initrd file), pages without bss are mapped from it as is, writable
+// ones copy-on-write. Archive keeps its own reference, so such page is
+// copied on write even if only one task maps it.
+static int task_load_segment(struct task *task, const char *name, uint8_t *binary,
+			     struct elf64_program_header *ph, bool shared)
 {
 	uint64_t va = ROUND_DOWN(ph->p_va, PAGE_SIZE);
-	uint64_t size = ROUND_UP(ph->p_memsz, PAGE_SIZE);
+	uint64_t file_end = ROUND_UP(ph->p_va + ph->p_filesz, PAGE_SIZE);
+	uint64_t end = ROUND_UP(ph->p_va + ph->p_memsz, PAGE_SIZE);
+	bool write = (ph->p_flags & ELF_PHEADER_FLAG_WRITE) != 0;
+
+	if (vma_insert(task, va, end, write ? VMA_WRITE : 0) != 0) {
+		terminal_printf("Can't load `%s': invalid segment address\n", name);
+		return -1;
+	}
 
-	// Allocate space for segment
-	for (uint64_t i = 0; i < size; i += PAGE_SIZE) {
-		struct page *page = page_alloc();
+	// File page must match the segment page
+	shared = shared && (ph->p_offset - ph->p_va) % PAGE_SIZE == 0;
+
+	for (uint64_t page_va = va; page_va < file_end; page_va += PAGE_SIZE) {
+		// Part of the file, which falls into this page
+		uint64_t from = MAX(page_va, ph->p_va);
+		uint64_t to = MIN(page_va + PAGE_SIZE, ph->p_va + ph->p_filesz);
+		uint64_t bss_end = MIN(page_va + PAGE_SIZE, ph->p_va + ph->p_memsz);
+		struct page *page;
+
+		if (shared && bss_end <= to) {
+			page = pa2page(PADDR(binary + ph->p_offset - (ph->p_va - page_va)));
+			if (page_insert(task->pml4, page, page_va, PTE_U | (write ? PTE_COW : 0)) != 0) {
+				terminal_printf("Can't load `%s': page_insert failed\n", name);
+				return -1;
+			}
+
+			continue;
+		}
 
-		if (page == NULL) {
+		if ((page = page_alloc_zeroed()) == NULL) {
 			terminal_printf("Can't load `%s': no more free pages\n", name);
 			return -1;
 		}
 
-		if (page_insert(task->pml4, page, va + i, PTE_U | PTE_W) != 0) {
+		if (page_insert(task->pml4, page, page_va, PTE_U | (write ? PTE_W : 0)) != 0) {
+			page_free(page);
 			terminal_printf("Can't load `%s': page_insert failed\n", name);
 			return -1;
 		}
-	}
 
-	// Load segment
-	memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-	memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
+		memcpy((uint8_t *)page2kva(page) + (from - page_va),
+		       binary + ph->p_offset + (from - ph->p_va), to - from);
+	}
 
 	return 0;
 }
 
 static int task_load(struct task *task, const char *name, uint8_t *binary, size_t size)
 {
-	struct kernel_config *config = (struct kernel_config *)KERNEL_INFO;
 	struct elf64_header *elf_header = (struct elf64_header *)binary;
+	bool shared = initrd_contains(binary);
 
 	if (elf_header->e_magic != ELF_MAGIC) {
 		terminal_printf("Can't load task `%s': invalid elf magic\n", name);
 		return -1;
 	}
+	if (elf_header->e_entry >= USER_TOP) {
+		terminal_printf("Can't load task `%s': invalid entry point\n", name);
+		return -1;
+	}
 
-	lcr3(PADDR(task->pml4));
 	for (struct elf64_program_header *ph = ELF64_PHEADER_FIRST(elf_header);
 	     ph < ELF64_PHEADER_LAST(elf_header); ph++) {
 		if (ph->p_type != ELF_PHEADER_TYPE_LOAD)
 			continue;
-		if (ph->p_offset > size) {
+		if (ph->p_offset + ph->p_filesz > size) {
 			terminal_printf("Can't load task `%s': truncated binary\n", name);
-			goto cleanup;
+			return -1;
 		}
-		if (task_load_segment(task, name, binary, ph) != 0)
-			goto cleanup;
+		if (task_load_segment(task, name, binary, ph, shared) != 0)
+			return -1;
 	}
 
 	task->context.rip = elf_header->e_entry;
 
 	return 0;
+}
 
-cleanup:
-	lcr3(PADDR(config->pml4.ptr));
+// Loads binary into empty user space and prepares initial context
+static int task_setup(struct task *task, const char *name, uint8_t *binary, size_t size)
+{
+	memset(&task->context, 0, sizeof(task->context));
+	if (task_load(task, name, binary, size) != 0)
+		return -1;
 
-	return -1;
+	// Stack pages are allocated on demand, area grows down
+	if (vma_insert(task, USER_STACK_TOP - PAGE_SIZE, USER_STACK_TOP,
+		       VMA_WRITE | VMA_STACK) != 0) {
+		terminal_printf("Can't create `%s': stack overlaps with segments\n", name);
+		return -1;
+	}
+
+	task->context.cs = GD_UT | GDT_DPL_U;
+	task->context.ds = GD_UD | GDT_DPL_U;
+	task->context.es = GD_UD | GDT_DPL_U;
+	task->context.ss = GD_UD | GDT_DPL_U;
+	task->context.rsp = USER_STACK_TOP;
+
+	return 0;
 }
 
+// Returns id of the new task
 int task_create(const char *name, uint8_t *binary, size_t size)
 {
-	struct page *stack;
 	struct task *task;
 
 	if ((task = task_new(name)) == NULL)
 		return -1;
 
-	if (task_load(task, name, binary, size) != 0)
-		goto cleanup;
-
-	if ((stack = page_alloc()) == NULL) {
-		terminal_printf("Can't create `%s': no memory for user stack\n", name);
-		goto cleanup;
+	if (task_setup(task, name, binary, size) != 0) {
+		task_destroy(task);
+		return -1;
 	}
-	if (page_insert(task->pml4, stack, USER_STACK_TOP-PAGE_SIZE, PTE_U | PTE_W) != 0) {
-		terminal_printf("Can't create `%s': page_insert failed\n", name);
-		goto cleanup;
+
+	task_make_ready(task);
+
+	return task->id;
+}
+
+// Starts initrd program `name' in a new address space, without
+// copying anything from the caller
+int task_spawn(const char *name)
+{
+	const struct initrd_file *file = initrd_lookup(name);
+
+	if (file == NULL) {
+		terminal_printf("Can't spawn `%s': no such program\n", name);
+		return -1;
 	}
 
-	task->context.cs = GD_UT | GDT_DPL_U;
-	task->context.ds = GD_UD | GDT_DPL_U;
-	task->context.es = GD_UD | GDT_DPL_U;
-	task->context.ss = GD_UD | GDT_DPL_U;
-	task->context.rsp = USER_STACK_TOP;
+	return task_create(file->name, initrd_data(file), file->size);
+}
 
-	task->state = TASK_STATE_READY;
+// Replaces user space of the current task by initrd program `name'.
+// Returns only on error, if old user space is still alive.
+int task_exec(struct task *task, const char *name)
+{
+	const struct initrd_file *file = initrd_lookup(name);
+	struct cpu_context *cpu = cpu_context();
+	pml4e_t *pml4;
 
-	return 0;
+	assert(task == cpu->task);
 
-cleanup:
-	task_destroy(task);
-	return -1;
+	if (file == NULL) {
+		terminal_printf("Can't exec `%s': no such program\n", name);
+		return -1;
+	}
+	if ((pml4 = task_pml4_new()) == NULL) {
+		terminal_printf("Can't exec `%s': no memory for new pml4\n", name);
+		return -1;
+	}
+
+	if (task->vfork_parent != NULL)
+		task_vfork_done(task);
+	else
+		task_unmap(task);
+	vma_destroy(task);
+
+	task->pml4 = pml4;
+	task->asid = tlb_asid_new();
+	tlb_switch(pml4, task->asid);
+	cpu->pml4 = pml4;
+	strncpy(task->name, file->name, sizeof(task->name));
+
+	if (task_setup(task, file->name, initrd_data(file), file->size) != 0) {
+		// Old user space is lost already
+		task_destroy(task);
+		schedule();
+	}
+
+	return 0;
 }
 
 void task_run(struct task *task)
 {
+	struct cpu_context *cpu = cpu_context();
+
+	if (task->killed) {
+		// Task was killed, while it was running on this cpu
+		task_destroy(task);
+		return schedule();
+	}
+
 	// Always enable interrupts
 	task->context.rflags |= RFLAGS_IF;
 	task->state = TASK_STATE_RUN;
 
+	if (task == cpu->idle)
+		cpu->idle_start = rdtsc();
+
+	timer_update();
+
+	// Task context is not modified by other cpus, when task is running
+	kernel_unlock();
+
 	asm volatile(
 		"movq %0, %%rsp\n\t"
 
@@ -320,26 +732,22 @@ void task_run(struct task *task)
 void schedule(void)
 {
 	struct cpu_context *cpu = cpu_context();
-	static int next_task_idx = 0;
+	struct task *task = cpu->task;
 
-	for (uint32_t i = next_task_idx, j = 0; j < TASK_MAX_CNT; j++) {
-		uint32_t idx = (i + j) % TASK_MAX_CNT;
+	// Preempted task goes to the end of its queue
+	if (task != &cpu->self_task && task != cpu->idle &&
+	    task->state == TASK_STATE_READY)
+		task_make_ready(task);
 
-		if (tasks[idx].state != TASK_STATE_READY) {
-			// We use only one processor, so only one task may in `RUN' state
-			assert(tasks[idx].state != TASK_STATE_RUN);
-			continue;
-		}
+	if ((task = runq_pick(&cpu->runq)) == NULL)
+		task = cpu->idle;
 
-		if (rcr3() != PADDR(tasks[idx].pml4))
-			lcr3(PADDR(tasks[idx].pml4));
+	timer_slice_reset();
 
-		cpu->task = &tasks[idx];
-		cpu->pml4 = cpu->task->pml4;
+	tlb_switch(task->pml4, task->asid);
 
-		next_task_idx = idx + 1;
-		task_run(&tasks[idx]);
-	}
+	cpu->task = task;
+	cpu->pml4 = cpu->task->pml4;
 
-	panic("no more tasks");
+	task_run(task);
 }
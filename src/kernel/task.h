@@ -6,7 +6,10 @@
 #include <stdbool.h>
 
 #include "stdlib/queue.h"
+#include "kernel/lib/sync/spinlock.h"
 #include "kernel/lib/memory/mmu.h"
+#include "kernel/interrupt/timer.h"
+#include "kernel/vma.h"
 
 struct gprs {
 	uint64_t rax;
@@ -59,44 +62,71 @@ enum task_state {
 	TASK_STATE_READY	= 1,
 	TASK_STATE_RUN		= 2,
 	TASK_STATE_DONT_RUN	= 3,
+	TASK_STATE_SLEEP	= 4,
 };
 
 typedef uint32_t task_id_t;
 
+// Lower value means higher priority
+#define TASK_PRIORITY_CNT	32
+#define TASK_PRIORITY_DEFAULT	(TASK_PRIORITY_CNT / 2)
+
 struct task {
 	struct task_context context;
 	enum task_state state;
+	uint8_t priority;
 
 	task_id_t id;
 	char name[64];
 
-	LIST_ENTRY(task) free_link;
+	uint16_t cpu;			// task runs only on this cpu
+
+	TAILQ_ENTRY(task) link;		// link in the list of all tasks
+	TAILQ_ENTRY(task) runq_link;	// link in the run queue (if ready)
+	TAILQ_ENTRY(task) wait_link;	// link in the queue of event waiters
+	LIST_ENTRY(task) hash_link;	// link in the task id hash
+
+	bool killed;			// destroy, when the task enters kernel
+	struct timer_event timer;	// wakes up sleeping task
+	struct task *vfork_parent;	// address space is borrowed from it
 
 	pml4e_t *pml4; // virtual address of pml4
+	struct vma_list vmas; // user memory areas
+	uint64_t asid; // address space id, selects PCID (see `tlb_switch')
+};
+
+TAILQ_HEAD(task_queue, task);
+
+// Ready tasks, one queue per priority. Bit `i' of `mask' is set
+// if `queue[i]' isn't empty. Running task isn't inside run queue.
+struct task_runq {
+	struct spinlock lock;	// other cpus insert tasks too
+	uint32_t mask;
+	uint32_t cnt;
+	struct task_queue queue[TASK_PRIORITY_CNT];
 };
 
 void task_init(void);
+void task_init_cpu(void);
 
 void task_list(void);
 void task_kill(task_id_t id);
+void task_nice(task_id_t id, uint32_t priority);
+
+void task_make_ready(struct task *task);
+void task_sleep(struct task *task, uint64_t ms);
 
 struct task *task_new(const char *name);
 void task_destroy(struct task *task);
 int task_create(const char *name, uint8_t *binary, size_t size);
+int task_spawn(const char *name);
+int task_exec(struct task *task, const char *name);
+struct task *task_vfork(struct task *parent);
 
 void task_run(struct task *task);
 void schedule(void);
 
-#define TASK_MAX_CNT	1024
-
-#define TASK_STATIC_INITIALIZER(name_) {					\
-	extern uint8_t _binary_## ___ ## user_## name_ ##_bin_start[];		\
-	extern uint8_t _binary_## ___ ## user_## name_ ##_bin_end[];		\
-										\
-	uint8_t *binary_ = _binary_## ___ ## user_## name_ ##_bin_start;	\
-	uint8_t *end_ = _binary_## ___ ## user_## name_ ##_bin_end;		\
-										\
-	task_create(#name_, binary_, end_ - binary_);				\
-}
+// Programs are taken from initrd, so kernel needn't be relinked
+#define TASK_STATIC_INITIALIZER(name_) task_spawn(#name_)
 
 #endif
@@ -2,6 +2,7 @@
 #include "stdlib/string.h"
 
 #include "kernel/asm.h"
+#include "kernel/cpu.h"
 #include "kernel/thread.h"
 
 #include "kernel/misc/gdt.h"
@@ -18,10 +19,16 @@ static void thread_foo(struct task *thread, thread_func_t foo, void *arg)
 
 	foo(arg);
 
-	task_destroy(thread);
+	// Thread can't release the stack it runs on, so it is only marked
+	// dead here. Interrupts stay disabled, `int3' handler destroys the
+	// thread from interrupt stack (ist1) and calls schedule.
+	irq_save();
+	kernel_lock();
+	thread->killed = true;
+	thread->state = TASK_STATE_DONT_RUN;
 
-	// call schedule
 	asm volatile ("int3");
+	panic("dead thread is running");
 }
 
 // Don't override stack (don't use large `data')
@@ -92,5 +99,5 @@ cleanup:
 void thread_run(struct task *thread)
 {
 	assert(thread->state == TASK_STATE_DONT_RUN);
-	thread->state = TASK_STATE_READY;
+	task_make_ready(thread);
 }
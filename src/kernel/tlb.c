@@ -0,0 +1,74 @@
+#include <cpuid.h>
+
+#include "kernel/asm.h"
+#include "kernel/cpu.h"
+#include "kernel/tlb.h"
+#include "kernel/lib/memory/layout.h"
+
+// Set only if all cpus support PCID (cpus are the same in practice)
+static bool tlb_pcid = true;
+static uint64_t tlb_last_asid;
+
+// Must be called by each cpu
+void tlb_init_cpu(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uintptr_t cr4 = rcr4();
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+		tlb_pcid = false;
+		return;
+	}
+
+	// Kernel mappings are global (see `loader_map_section'), they
+	// survive cr3 reload. PGE - edx[13].
+	if ((edx & (1 << 13)) != 0)
+		cr4 |= CR4_PGE;
+
+	// PCID - ecx[17], cr3 must have zero PCID, when it is enabled
+	if ((ecx & (1 << 17)) != 0 && (rcr3() & CR3_PCID_MASK) == 0)
+		cr4 |= CR4_PCIDE;
+	else
+		tlb_pcid = false;
+
+	lcr4(cr4);
+}
+
+// Address space ids aren't reused, so TLB entries of destroyed address
+// space are never used by the new one
+uint64_t tlb_asid_new(void)
+{
+	return __atomic_add_fetch(&tlb_last_asid, 1, __ATOMIC_RELAXED);
+}
+
+// Loads `pml4'. Each cpu keeps PCIDs of last `TLB_PCID_CNT' address
+// spaces, so switch between them doesn't flush TLB.
+void tlb_switch(pml4e_t *pml4, uint64_t asid)
+{
+	struct tlb_pcid *pcid = &cpu_context()->pcid;
+	uintptr_t cr3 = PADDR(pml4);
+	uint32_t i;
+
+	if (tlb_pcid == false || asid == 0) {
+		if (rcr3() != cr3)
+			lcr3(cr3);
+		return;
+	}
+
+	for (i = 0; i < TLB_PCID_CNT; i++) {
+		if (pcid->asid[i] != asid)
+			continue;
+
+		cr3 |= i + 1;
+		if (rcr3() != cr3)
+			lcr3(cr3 | CR3_NOFLUSH);
+		return;
+	}
+
+	// Entries of the replaced address space are flushed
+	i = pcid->next;
+	pcid->next = (pcid->next + 1) % TLB_PCID_CNT;
+	pcid->asid[i] = asid;
+
+	lcr3(cr3 | (i + 1));
+}
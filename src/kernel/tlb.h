@@ -0,0 +1,22 @@
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <stdint.h>
+
+#include "kernel/lib/memory/mmu.h"
+
+// Number of address spaces, which keep their TLB entries on each cpu
+// (PCID 0 is used by tasks without address space id)
+#define TLB_PCID_CNT	8
+
+struct tlb_pcid {
+	uint64_t asid[TLB_PCID_CNT];	// address space of PCID `i + 1'
+	uint32_t next;			// slot to replace next time
+};
+
+void tlb_init_cpu(void);
+
+uint64_t tlb_asid_new(void);
+void tlb_switch(pml4e_t *pml4, uint64_t asid);
+
+#endif
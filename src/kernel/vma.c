@@ -0,0 +1,365 @@
+#include "stdlib/assert.h"
+#include "stdlib/string.h"
+
+#include "kernel/lib/memory/map.h"
+#include "kernel/lib/memory/slab.h"
+#include "kernel/lib/memory/layout.h"
+#include "kernel/lib/console/terminal.h"
+
+#include "kernel/vma.h"
+#include "kernel/task.h"
+#include "kernel/misc/util.h"
+
+static struct kmem_cache *vma_cache;
+
+// Mapped (read only or copy-on-write) instead of never written pages
+static struct page *vma_zero_page;
+
+void vma_init(void)
+{
+	vma_cache = kmem_cache_create("vma", sizeof(struct vma), sizeof(uintptr_t), NULL);
+	if (vma_cache == NULL)
+		panic("can't create vma cache");
+
+	if ((vma_zero_page = page_alloc_zeroed()) == NULL)
+		panic("can't allocate zero page");
+	page_incref(vma_zero_page);
+}
+
+// Address space of vfork child belongs to its parent
+static struct vma_list *vma_task_list(struct task *task)
+{
+	while (task->vfork_parent != NULL)
+		task = task->vfork_parent;
+
+	return &task->vmas;
+}
+
+static struct vma *vma_alloc(uintptr_t start, uintptr_t end, unsigned flags)
+{
+	struct vma *vma;
+
+	if ((vma = kmem_cache_alloc(vma_cache)) == NULL)
+		return NULL;
+
+	vma->start = start;
+	vma->end = end;
+	vma->flags = flags;
+
+	return vma;
+}
+
+static struct vma *vma_find(struct vma_list *vmas, uintptr_t va)
+{
+	struct vma *vma;
+
+	TAILQ_FOREACH(vma, vmas, link) {
+		if (va < vma->start)
+			break;
+		if (va < vma->end)
+			return vma;
+	}
+
+	return NULL;
+}
+
+// Fails if range overlaps with existing area
+int vma_insert(struct task *task, uintptr_t start, uintptr_t end, unsigned flags)
+{
+	struct vma_list *vmas = vma_task_list(task);
+	struct vma *vma, *next;
+
+	assert(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+	if (start >= end || end > USER_TOP)
+		return -1;
+
+	// The first area, which ends after `start'
+	TAILQ_FOREACH(next, vmas, link) {
+		if (next->end > start)
+			break;
+	}
+	if (next != NULL && next->start < end)
+		return -1;
+
+	if ((vma = vma_alloc(start, end, flags)) == NULL)
+		return -1;
+
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, vma, link);
+	else
+		TAILQ_INSERT_TAIL(vmas, vma, link);
+
+	return 0;
+}
+
+// Used by fork, pages are shared by page tables
+int vma_copy(struct task *dest, struct task *src)
+{
+	struct vma *vma, *copy;
+
+	TAILQ_FOREACH(vma, vma_task_list(src), link) {
+		if ((copy = vma_alloc(vma->start, vma->end, vma->flags)) == NULL) {
+			vma_destroy(dest);
+			return -1;
+		}
+
+		TAILQ_INSERT_TAIL(&dest->vmas, copy, link);
+	}
+
+	return 0;
+}
+
+// Frees areas of the task (mapped pages are released with page tables)
+void vma_destroy(struct task *task)
+{
+	struct vma *vma;
+
+	while ((vma = TAILQ_FIRST(&task->vmas)) != NULL) {
+		TAILQ_REMOVE(&task->vmas, vma, link);
+		kmem_cache_free(vma_cache, vma);
+	}
+}
+
+// Stack area is extended down to `va', if it doesn't become larger
+// than `USER_STACK_SIZE_MAX'
+static struct vma *vma_grow_stack(struct vma_list *vmas, uintptr_t va)
+{
+	uintptr_t start = ROUND_DOWN(va, PAGE_SIZE);
+	struct vma *vma, *prev;
+
+	TAILQ_FOREACH(vma, vmas, link) {
+		if ((vma->flags & VMA_STACK) != 0)
+			break;
+	}
+
+	if (vma == NULL || va >= vma->start || va < vma->end - USER_STACK_SIZE_MAX)
+		return NULL;
+
+	prev = TAILQ_PREV(vma, vma_list, link);
+	if (prev != NULL && prev->end > start)
+		return NULL;
+
+	vma->start = start;
+
+	return vma;
+}
+
+static int vma_fault_large(struct task *task, struct vma *vma, uintptr_t va)
+{
+	uintptr_t start = ROUND_DOWN(va, LARGE_PAGE_SIZE);
+	unsigned perm = PTE_U | ((vma->flags & VMA_WRITE) != 0 ? PTE_W : 0);
+	struct page *page;
+	pde_t *pde;
+
+	if (start < vma->start || start + LARGE_PAGE_SIZE > vma->end)
+		return -1;
+
+	// Some small pages are mapped already
+	pde = mmap_lookup_pde(task->pml4, start, true);
+	if (pde == NULL || (*pde & PDE_P) != 0)
+		return -1;
+
+	if ((page = page_alloc_order(LARGE_PAGE_ORDER)) == NULL)
+		return -1;
+	memset(page2kva(page), 0, LARGE_PAGE_SIZE);
+
+	if (page_insert_large(task->pml4, page, start, perm) != 0) {
+		page_free(page);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Populates page on the first access. Read of never written page maps
+// shared zero page, write fault will copy it.
+int vma_fault(struct task *task, uintptr_t va, bool write)
+{
+	struct vma_list *vmas = vma_task_list(task);
+	uintptr_t page_va = ROUND_DOWN(va, PAGE_SIZE);
+	struct page *page;
+	struct vma *vma;
+	pte_t *pte;
+
+	if ((vma = vma_find(vmas, va)) == NULL && (vma = vma_grow_stack(vmas, va)) == NULL)
+		return -1;
+	if (write == true && (vma->flags & VMA_WRITE) == 0)
+		return -1;
+
+	if ((vma->flags & VMA_LARGE) != 0 && vma_fault_large(task, vma, va) == 0)
+		return 0;
+
+	if ((pte = mmap_lookup(task->pml4, page_va, true)) == NULL)
+		return -1;
+	if ((*pte & PTE_P) != 0)
+		// Nothing to do, fault wasn't caused by missing page
+		return -1;
+
+	if (write == false) {
+		unsigned perm = PTE_U | ((vma->flags & VMA_WRITE) != 0 ? PTE_COW : 0);
+
+		return page_insert(task->pml4, vma_zero_page, page_va, perm);
+	}
+
+	if ((page = page_alloc_zeroed()) == NULL)
+		return -1;
+
+	if (page_insert(task->pml4, page, page_va, PTE_U | PTE_W) != 0) {
+		page_free(page);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Finds physical address of user `va', page is populated on demand
+static int vma_user_pa(struct task *task, uintptr_t va, uintptr_t *pa)
+{
+	pde_t *pde;
+	pte_t *pte;
+
+	if (va >= USER_TOP)
+		return -1;
+
+	for (int try = 0; try < 2; try++) {
+		if (try != 0 && vma_fault(task, va, false) != 0)
+			return -1;
+
+		pde = mmap_lookup_pde(task->pml4, va, false);
+		if (pde != NULL && (*pde & PDE_P) != 0 && (*pde & PDE_PS) != 0 &&
+		    (*pde & PDE_U) != 0) {
+			*pa = LARGE_PAGE_ADDR(*pde) + va % LARGE_PAGE_SIZE;
+			return 0;
+		}
+
+		pte = mmap_lookup(task->pml4, va, false);
+		if (pte != NULL && (*pte & PTE_P) != 0 && (*pte & PTE_U) != 0) {
+			*pa = PTE_ADDR(*pte) + va % PAGE_SIZE;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+// Copies null terminated string from user space into `dst' (at most
+// `size' - 1 chars, result is always terminated). User memory is read
+// through direct mapping, so kernel never faults on user pointers.
+// Returns length of copied string or -1 if `src' isn't readable.
+int vma_copy_string(struct task *task, char *dst, uintptr_t src, size_t size)
+{
+	uintptr_t pa = 0;
+	size_t len;
+
+	assert(size != 0);
+
+	for (len = 0; len < size - 1; len++, src++, pa++) {
+		if ((len == 0 || src % PAGE_SIZE == 0) && vma_user_pa(task, src, &pa) != 0)
+			return -1;
+		if ((dst[len] = *(char *)VADDR(pa)) == '\0')
+			break;
+	}
+	dst[len] = '\0';
+
+	return len;
+}
+
+// Creates anonymous area, returns its address or 0. If `addr' is 0,
+// the first suitable hole is used.
+uintptr_t vma_mmap(struct task *task, uintptr_t addr, size_t size, unsigned flags)
+{
+	uintptr_t align = (flags & VMA_LARGE) != 0 ? LARGE_PAGE_SIZE : PAGE_SIZE;
+	struct vma *vma;
+
+	size = ROUND_UP(size, align);
+	if (size == 0 || size > USER_MMAP_TOP - USER_MMAP_BASE)
+		return 0;
+
+	if (addr != 0) {
+		if (addr % align != 0 || addr < USER_MMAP_BASE || addr > USER_MMAP_TOP - size)
+			return 0;
+
+		return vma_insert(task, addr, addr + size, flags) == 0 ? addr : 0;
+	}
+
+	addr = USER_MMAP_BASE;
+	TAILQ_FOREACH(vma, vma_task_list(task), link) {
+		if (vma->end <= addr)
+			continue;
+		if (vma->start >= addr + size)
+			break;
+
+		addr = ROUND_UP(vma->end, align);
+	}
+
+	if (addr > USER_MMAP_TOP - size)
+		return 0;
+
+	return vma_insert(task, addr, addr + size, flags) == 0 ? addr : 0;
+}
+
+// Removes areas (or their parts) inside range and unmaps their pages.
+// All checks and allocations are done first, so on failure nothing is
+// changed.
+int vma_munmap(struct task *task, uintptr_t addr, size_t size)
+{
+	struct tlb_gather tlb = TLB_GATHER_INITIALIZER;
+	struct vma_list *vmas = vma_task_list(task);
+	uintptr_t end = addr + ROUND_UP(size, PAGE_SIZE);
+	struct vma *vma, *next, *tail = NULL;
+
+	if (addr % PAGE_SIZE != 0 || end <= addr || end > USER_TOP)
+		return -1;
+
+	TAILQ_FOREACH(vma, vmas, link) {
+		if (vma->end <= addr || vma->start >= end)
+			continue;
+
+		// Large pages aren't split
+		if ((vma->flags & VMA_LARGE) != 0 &&
+		    (addr % LARGE_PAGE_SIZE != 0 || end % LARGE_PAGE_SIZE != 0))
+			return -1;
+
+		// Hole inside the area, it is the only area in range
+		if (vma->start < addr && vma->end > end &&
+		    (tail = vma_alloc(end, vma->end, vma->flags)) == NULL)
+			return -1;
+	}
+
+	for (vma = TAILQ_FIRST(vmas); vma != NULL; vma = next) {
+		next = TAILQ_NEXT(vma, link);
+
+		if (vma->end <= addr || vma->start >= end)
+			continue;
+
+		if (vma->start < addr && vma->end > end) {
+			TAILQ_INSERT_AFTER(vmas, vma, tail, link);
+			vma->end = addr;
+		} else if (vma->start < addr) {
+			vma->end = addr;
+		} else if (vma->end > end) {
+			vma->start = end;
+		} else {
+			TAILQ_REMOVE(vmas, vma, link);
+			kmem_cache_free(vma_cache, vma);
+		}
+	}
+
+	for (uintptr_t va = addr; va < end;) {
+		pde_t *pde = mmap_lookup_pde(task->pml4, va, false);
+
+		if (pde == NULL || (*pde & PDE_P) == 0) {
+			// Skip whole page table
+			va = ROUND_DOWN(va, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+		} else if ((*pde & PDE_PS) != 0) {
+			page_remove_large(task->pml4, va);
+			va += LARGE_PAGE_SIZE;
+		} else {
+			page_remove_tlb(task->pml4, va, &tlb);
+			va += PAGE_SIZE;
+		}
+	}
+	tlb_gather_flush(&tlb);
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __VMA_H__
+#define __VMA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "stdlib/queue.h"
+
+#define VMA_WRITE	(1 << 0)	// pages are writable
+#define VMA_STACK	(1 << 1)	// grows down on fault below the area
+#define VMA_LARGE	(1 << 2)	// populated by 2Mb pages, where possible
+
+// Virtual memory area of the task. Pages of the area are allocated
+// on the first access (see `vma_fault').
+struct vma {
+	uintptr_t start;	// page aligned
+	uintptr_t end;		// first address after the area
+	unsigned flags;
+
+	TAILQ_ENTRY(vma) link;	// areas are sorted by address
+};
+TAILQ_HEAD(vma_list, vma);
+
+struct task;
+
+void vma_init(void);
+
+int vma_insert(struct task *task, uintptr_t start, uintptr_t end, unsigned flags);
+int vma_copy(struct task *dest, struct task *src);
+void vma_destroy(struct task *task);
+
+int vma_fault(struct task *task, uintptr_t va, bool write);
+int vma_copy_string(struct task *task, char *dst, uintptr_t src, size_t size);
+
+uintptr_t vma_mmap(struct task *task, uintptr_t addr, size_t size, unsigned flags);
+int vma_munmap(struct task *task, uintptr_t addr, size_t size);
+
+#endif
@@ -1,29 +1,93 @@
+#include <cpuid.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "string.h"
 
+#ifdef __x86_64__
+# define STRING_MOVS	"rep movsq"
+# define STRING_STOS	"rep stosq"
+#else
+# define STRING_MOVS	"rep movsl"
+# define STRING_STOS	"rep stosl"
+#endif
+
+// Machine word, which is allowed to alias any other type
+typedef uintptr_t __attribute__((may_alias)) string_word_t;
+
+#define STRING_ONES	((uintptr_t)-1 / 0xff)		// 0x0101...01
+#define STRING_HIGHS	(STRING_ONES << 7)		// 0x8080...80
+
+// Not zero if `w' contains zero byte
+#define STRING_HAS_ZERO(w_) (((w_) - STRING_ONES) & ~(w_) & STRING_HIGHS)
+
+// Cpu supports fast `rep movsb/stosb' (ERMS or FSRM), set by `string_init'
+static bool string_fast_rep;
+
+void string_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	string_fast_rep = false;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	(void)eax; (void)ecx;
+
+	// ERMS - ebx[9], FSRM - edx[4]
+	string_fast_rep = (ebx & (1 << 9)) != 0 || (edx & (1 << 4)) != 0;
+}
+
 size_t strlen(const char *s)
 {
-	size_t r = 0;
+	const char *p = s;
+	const string_word_t *w;
 
-	while (s[r] != '\0')
-		r++;
+	for (; ((uintptr_t)p & (sizeof(*w) - 1)) != 0; p++)
+		if (*p == '\0')
+			return p - s;
 
-	return r;
+	// Aligned word never crosses page boundary, so it is safe to
+	// read bytes after terminating zero
+	for (w = (const string_word_t *)p; STRING_HAS_ZERO(*w) == 0; w++)
+		/*do nothing*/;
+
+	for (p = (const char *)w; *p != '\0'; p++)
+		/*do nothing*/;
+
+	return p - s;
 }
 
 void *memset(void *s, int c, size_t n)
 {
-	for (size_t i = 0; i < n; i++)
-		*((uint8_t *)s + i) = (uint8_t)c;
+	uintptr_t word = (uint8_t)c * STRING_ONES;
+	size_t words = n / sizeof(word), tail = n % sizeof(word);
+	void *d = s;
+
+	if (string_fast_rep) {
+		asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+		return s;
+	}
+
+	asm volatile(STRING_STOS : "+D"(d), "+c"(words) : "a"(word) : "memory");
+	asm volatile("rep stosb" : "+D"(d), "+c"(tail) : "a"(c) : "memory");
 
 	return s;
 }
 
 void *memcpy(void *dest, const void *src, size_t n)
 {
-	for (size_t i = 0; i < n; i++)
-		*((uint8_t *)dest + i) = *((uint8_t *)src + i);
+	size_t words = n / sizeof(uintptr_t), tail = n % sizeof(uintptr_t);
+	void *d = dest;
+
+	if (string_fast_rep) {
+		asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+		return dest;
+	}
+
+	asm volatile(STRING_MOVS : "+D"(d), "+S"(src), "+c"(words) : : "memory");
+	asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(tail) : : "memory");
 
 	return dest;
 }
@@ -32,6 +96,25 @@ int strcmp(const char *s1, const char *s2)
 {
 	int r;
 
+	// Compare by words, if both strings may be aligned at once
+	if ((((uintptr_t)s1 ^ (uintptr_t)s2) & (sizeof(string_word_t) - 1)) == 0) {
+		const string_word_t *w1, *w2;
+
+		for (; ((uintptr_t)s1 & (sizeof(*w1) - 1)) != 0; s1++, s2++) {
+			if ((r = *s1 - *s2) != 0 || *s1 == '\0')
+				return r;
+		}
+
+		w1 = (const string_word_t *)s1;
+		w2 = (const string_word_t *)s2;
+		while (*w1 == *w2 && STRING_HAS_ZERO(*w1) == 0)
+			w1++, w2++;
+
+		// Find the difference inside the last word
+		s1 = (const char *)w1;
+		s2 = (const char *)w2;
+	}
+
 	while ((r = *s1 - *s2) == 0 && *s1 != '\0') {
 		s1++, s2++;
 	}
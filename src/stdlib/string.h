@@ -13,4 +13,7 @@ int strncmp(const char *s1, const char *s2, size_t n);
 
 char *strncpy(char *dest, const char *src, size_t n);
 
+// Selects the fastest implementation for current cpu
+void string_init(void);
+
 #endif
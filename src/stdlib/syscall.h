@@ -9,9 +9,20 @@ enum syscall {
 	SYSCALL_EXIT	= 1,
 	SYSCALL_FORK	= 2,
 	SYSCALL_YIELD	= 3,
+	SYSCALL_SLEEP	= 4,
+	SYSCALL_CLOCK_GETTIME	= 5,
+	SYSCALL_SPAWN	= 6,
+	SYSCALL_VFORK	= 7,
+	SYSCALL_EXEC	= 8,
+	SYSCALL_MMAP	= 9,
+	SYSCALL_MUNMAP	= 10,
 
 	SYSCALL_LAST
 };
+
+// `SYSCALL_MMAP' flags, pages are always readable
+#define MMAP_WRITE	(1 << 0)
+#define MMAP_LARGE	(1 << 1)	// back area by 2Mb pages
 #endif
 
 #endif
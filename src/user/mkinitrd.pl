@@ -0,0 +1,72 @@
+use strict;
+use warnings;
+
+# Packs user programs into read-only archive (see `kernel/initrd.h').
+# File is named by the part of its base name before the first dot.
+
+use constant {
+	MAGIC		=> 0x44525449,
+	NAME_MAX	=> 32,
+	PAGE_SIZE	=> 4096,
+	HEADER_SIZE	=> 16,
+	FILE_SIZE	=> 40,
+};
+
+my ($archive, @paths) = @ARGV;
+die "Usage: $0 <ARCHIVE> <FILE>...\n" if (!defined $archive || !@paths);
+
+# Must be the same, as `initrd_hash()'
+sub initrd_hash {
+	my $hash = 2166136261;
+
+	$hash = (($hash ^ $_) * 16777619) & 0xFFFFFFFF for (unpack 'C*', shift);
+
+	return $hash;
+}
+
+sub round_up {
+	my ($value, $align) = @_;
+
+	return int(($value + $align - 1) / $align) * $align;
+}
+
+# Hash table is kept at most half full
+my $slots = 2;
+$slots *= 2 while ($slots <= 2 * @paths);
+
+my @slot = (0) x $slots;
+my (@files, %seen);
+
+my $offset = round_up(HEADER_SIZE + 4 * $slots + FILE_SIZE * @paths, PAGE_SIZE);
+for my $path (@paths) {
+	my ($name) = $path =~ m{([^/.]+)[^/]*$} or die "invalid file name `$path'\n";
+	die "file name `$name' is too long\n" if (length $name >= NAME_MAX);
+	die "duplicate file `$name'\n" if ($seen{$name}++);
+
+	open my $fh, '<:raw', $path or die "can't open `$path': $!\n";
+	my $data = do { local $/; <$fh> };
+	close $fh;
+
+	my $i = initrd_hash($name) & ($slots - 1);
+	$i = ($i + 1) & ($slots - 1) while ($slot[$i] != 0);
+	$slot[$i] = @files + 1;
+
+	push @files, { name => $name, offset => $offset, data => $data };
+	$offset = round_up($offset + length $data, PAGE_SIZE);
+}
+
+my $size = @files ? $files[-1]{offset} + length $files[-1]{data} : 0;
+my $image = pack 'V4', MAGIC, scalar @files, $slots, $size;
+$image .= pack 'V*', @slot;
+$image .= pack 'a' . NAME_MAX . 'V2', $_->{name}, $_->{offset}, length $_->{data} for (@files);
+
+for my $file (@files) {
+	$image .= "\0" x ($file->{offset} - length $image);
+	$image .= $file->{data};
+}
+
+open my $fh, '>:raw', $archive or die "can't open `$archive': $!\n";
+print {$fh} $image;
+close $fh;
+
+print {*STDERR} "initrd: ", scalar @files, " files, $size bytes\n";
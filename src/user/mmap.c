@@ -0,0 +1,50 @@
+#include "stdlib/syscall.h"
+#include "user/syscall.h"
+
+#define MMAP_SIZE	(4096 * 16)
+#define MMAP_LARGE_SIZE	(2 * 1024 * 1024)
+
+static char bss[4096 * 4]; // populated on the first access
+
+int main(void)
+{
+	char *area, *large;
+
+	if (bss[sizeof(bss) - 1] != 0) {
+		sys_puts("bss isn't zeroed\n");
+		return -1;
+	}
+	bss[0] = 'b';
+
+	if ((area = sys_mmap(NULL, MMAP_SIZE, MMAP_WRITE)) == NULL) {
+		sys_puts("can't mmap\n");
+		return -1;
+	}
+
+	// Read maps zero page, write replaces it with private copy
+	if (area[MMAP_SIZE / 2] != 0) {
+		sys_puts("mmaped area isn't zeroed\n");
+		return -1;
+	}
+	area[MMAP_SIZE / 2] = 'a';
+
+	if (sys_munmap(area, MMAP_SIZE) != 0) {
+		sys_puts("can't munmap\n");
+		return -1;
+	}
+
+	if ((large = sys_mmap(NULL, MMAP_LARGE_SIZE, MMAP_WRITE | MMAP_LARGE)) == NULL) {
+		sys_puts("can't mmap large page\n");
+		return -1;
+	}
+	large[MMAP_LARGE_SIZE - 1] = 'l';
+
+	if (sys_munmap(large, MMAP_LARGE_SIZE) != 0) {
+		sys_puts("can't munmap large page\n");
+		return -1;
+	}
+
+	sys_puts("mmap: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#include "user/syscall.h"
+
+#define PERIOD_MS	1000
+
+int main(void)
+{
+	for (int i = 0; i < 10; i++) {
+		uint64_t start = sys_clock_gettime();
+
+		sys_sleep(PERIOD_MS);
+
+		if (sys_clock_gettime() - start < PERIOD_MS * 1000000ull)
+			sys_puts("woke up too early\n");
+		else
+			sys_puts("woke up\n");
+	}
+
+	return 0;
+}
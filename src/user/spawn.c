@@ -0,0 +1,22 @@
+#include "user/syscall.h"
+
+int main(void)
+{
+	if (sys_spawn("hello") == -1)
+		sys_puts("can't spawn\n");
+
+	int r = sys_vfork();
+
+	if (r == 0) {
+		// Only exec or exit are allowed inside vfork child
+		sys_exec("hello");
+		sys_exit(-1);
+	} else if (r == -1) {
+		sys_puts("can't vfork\n");
+		return -1;
+	}
+
+	sys_puts("parent: child has released address space\n");
+
+	return 0;
+}
@@ -1,22 +1,26 @@
 #include <stdint.h>
+#include <stddef.h>
 
 #include "stdlib/syscall.h"
 
 static int64_t syscall(enum syscall syscall, uint64_t arg1, uint64_t arg2,
 		       uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
+	register uint64_t r10 asm("r10") = arg4;
+	register uint64_t r8 asm("r8") = arg5;
 	int64_t ret;
 
-	asm volatile("int %1\n"
+	// `int $INTERRUPT_VECTOR_SYSCALL' with the same registers is still
+	// supported, but `syscall' is much cheaper. It clobbers rcx and r11.
+	asm volatile("syscall\n"
 		: "=a" (ret)
-		: "i" (INTERRUPT_VECTOR_SYSCALL),
-		  "a" (syscall),
-		  "b" (arg1),
-		  "c" (arg2),
+		: "a" (syscall),
+		  "D" (arg1),
+		  "S" (arg2),
 		  "d" (arg3),
-		  "D" (arg4),
-		  "S" (arg5)
-		: "cc", "memory");
+		  "r" (r10),
+		  "r" (r8)
+		: "rcx", "r11", "cc", "memory");
 
 	return ret;
 }
@@ -40,3 +44,50 @@ void sys_yield(void)
 {
 	return (void)syscall(SYSCALL_YIELD, 0, 0, 0, 0, 0);
 }
+
+// Task doesn't take cpu time while sleeping
+void sys_sleep(uint32_t ms)
+{
+	return (void)syscall(SYSCALL_SLEEP, ms, 0, 0, 0, 0);
+}
+
+// Returns monotonic time in nanoseconds
+uint64_t sys_clock_gettime(void)
+{
+	return syscall(SYSCALL_CLOCK_GETTIME, 0, 0, 0, 0, 0);
+}
+
+// Starts linked-in program `name', returns id of the new task
+int sys_spawn(const char *name)
+{
+	return syscall(SYSCALL_SPAWN, (uintptr_t)name, 0, 0, 0, 0);
+}
+
+// Child runs on the parent stack until `sys_exec' or `sys_exit', so it
+// would overwrite return address of the parent, if it was kept on the
+// stack. Return address is popped into rdx, which is restored for both.
+__attribute__((naked)) int sys_vfork(void)
+{
+	asm volatile("popq %%rdx\n\t"
+		     "movl %0, %%eax\n\t"
+		     "syscall\n\t"
+		     "jmpq *%%rdx"
+		     : : "i" (SYSCALL_VFORK));
+}
+
+// Returns only on error
+int sys_exec(const char *name)
+{
+	return syscall(SYSCALL_EXEC, (uintptr_t)name, 0, 0, 0, 0);
+}
+
+// Returns NULL on error, `flags' are `MMAP_*' from stdlib/syscall.h
+void *sys_mmap(void *addr, size_t size, unsigned flags)
+{
+	return (void *)syscall(SYSCALL_MMAP, (uintptr_t)addr, size, flags, 0, 0);
+}
+
+int sys_munmap(void *addr, size_t size)
+{
+	return syscall(SYSCALL_MUNMAP, (uintptr_t)addr, size, 0, 0, 0);
+}
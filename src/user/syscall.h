@@ -2,10 +2,18 @@
 #define __USER_SYSCALL_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 void sys_puts(const char *string);
 void sys_exit(int ret);
 int sys_fork(void);
 void sys_yield(void);
+void sys_sleep(uint32_t ms);
+uint64_t sys_clock_gettime(void);
+int sys_spawn(const char *name);
+int sys_vfork(void);
+int sys_exec(const char *name);
+void *sys_mmap(void *addr, size_t size, unsigned flags);
+int sys_munmap(void *addr, size_t size);
 
 #endif